@@ -3,11 +3,8 @@
 # Ensure any previous instances are stopped before starting.
 ./stop.sh
 
-# Clean up cache (but keep build artifacts for incremental compilation)
-echo "Cleaning cache..."
-if [ -d "cache" ]; then
-    rm -rf cache/*
-fi
+# The cache is kept across restarts: every entry records the source, template
+# and renderer it was built from, and outdated entries are rebuilt on demand.
 
 # Build and run
 echo "Building project..."
@@ -24,7 +21,7 @@ cd ..
 
 echo "" # Add a newline for cleaner output
 echo "Starting md_c_server..."
-nohup ./bin/md_c_server > server.log 2>&1 &
+nohup ./bin/md_c_server "$@" > server.log 2>&1 &
 PID=$!
 echo $PID > server.pid
 echo "Server started with PID: $PID"
@@ -1,110 +1,733 @@
 #include "cache.h"
 #include "utils.h"
+#include "http_helpers.h"
+#include "watcher.h"
+#include "disk_cache.h"
+#include "cache_file.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <zlib.h>
 #include <limits.h>
 #include <errno.h>
+#include <pthread.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#include "render_pool.h"
+#endif
+
+// Number of hash buckets in the memory cache. Must be a power of two.
+#define MEM_CACHE_BUCKETS 1024
+// Upper bound on the bytes of all bodies held in memory (including inflated
+// identity copies) before LRU eviction kicks in.
+#define MEM_CACHE_MAX_BYTES (64 * 1024 * 1024)
+// Entries are compressed once and served many times, so spend more CPU than
+// the zstd default; this is still faster than gzip at Z_DEFAULT_COMPRESSION.
+#define ZSTD_COMPRESSION_LEVEL 12
+
+// A compressed body kept in memory together with its preformatted headers.
+struct CacheEntry {
+    char *key;                      // Absolute source path
+    char *cache_key;                // Key of the disk cache files, see cache_file_path()
+    CacheKeyKind key_kind;
+    CacheBody bodies[ENCODING_COUNT]; // Body per content encoding; gzip is always present
+    char etags[ENCODING_COUNT][72]; // Each encoding is a separate representation
+    CacheFileMeta meta;             // Source, hash and validators, shared by all encodings
+    unsigned long validated_generation; // Watcher generation the entry was last known fresh at
+    time_t stale_since;             // When the entry was first found outdated, 0 while current
+    int refcount;                   // Held by the table and by each in-flight CacheResult
+    bool in_table;
+    CacheEntry *hash_next;
+    CacheEntry *lru_prev, *lru_next;
+};
+
+// A load in progress. Lives on the stack of the loading thread.
+typedef struct InflightLoad {
+    const char *key;
+    const CacheVersion *version;
+    struct InflightLoad *next;
+} InflightLoad;
+
+// The table is shared by all worker threads. `lock` guards the table, the LRU
+// list, the in-flight loads and every entry's refcount and validated_generation;
+// it is never held while rendering or doing disk I/O.
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t load_done;           // Signalled whenever an in-flight load ends
+    CacheEntry *buckets[MEM_CACHE_BUCKETS];
+    CacheEntry *lru_head, *lru_tail;    // Most recently used at the head
+    size_t total_bytes;
+    InflightLoad *inflight;
+    int stale_window;                   // Seconds an outdated entry may be served, 0 = never
+} s_mem_cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .load_done = PTHREAD_COND_INITIALIZER };
+
+// Hash of a template file, kept so that requests don't read it every time.
+typedef struct TemplateRecord {
+    char *path;
+    CacheVersion version;               // The file's mtime, size and inode when it was hashed
+    uint64_t hash;
+    unsigned long validated_generation; // Watcher generation the hash was last known current at
+    struct TemplateRecord *next;
+} TemplateRecord;
+
+// Templates are few, so a list will do. `lock` is held while a changed template is read.
+static struct {
+    pthread_mutex_t lock;
+    TemplateRecord *records;
+} s_templates = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// gzip body a running generator handed over with cache_attach_gzip()
+static _Thread_local CacheBody t_attached_gzip;
 
 // Forward declarations
-static time_t get_mtime(const char *path);
+static bool get_source_version(const char *path, CacheVersion *version);
+static bool version_equal(const CacheVersion *a, const CacheVersion *b);
+static uint64_t dependency_hash(const CacheDeps *deps);
+static uint64_t template_hash(const char *template_path);
 static char* gzip_compress(const char *data, size_t data_len, size_t *compressed_size);
-static void ensure_cache_dir_exists();
+static char* gzip_decompress(const char *data, size_t data_len, size_t size_hint, size_t *size);
+static const char *source_cache_key(const char *source_path, CacheKeyKind *kind);
+#ifdef HAVE_ZSTD
+static char* zstd_compress(const char *data, size_t data_len, size_t *compressed_size);
+static void rebuild_zstd_variant(const char *cache_key, CacheKeyKind kind, const CacheFileMeta *meta,
+                              CacheBody *bodies);
+#endif
+#ifdef HAVE_BROTLI
+static char* brotli_compress(const char *data, size_t data_len, size_t *compressed_size);
+static int brotli_job(const char *key);
+#endif
+static CacheEntry* mem_cache_find(const char *key);
+static CacheEntry* mem_cache_insert(const char *key, const char *cache_key, CacheKeyKind kind,
+                                    CacheBody *bodies, const CacheFileMeta *meta, unsigned long generation);
+static void mem_cache_remove(CacheEntry *entry);
+static void entry_unref(CacheEntry *entry);
+static size_t entry_bytes(const CacheEntry *entry);
+static void evict_over_budget(CacheEntry *keep);
+static const char *encoding_etag_suffix(ContentEncoding encoding);
+static CacheResult result_from_entry(CacheEntry *entry);
+static CacheResult lookup_or_generate(const char *source_path, const char *cache_key, CacheKeyKind kind,
+                                      const CacheVersion *version, unsigned long generation,
+                                      content_generator_t generator);
+static bool entry_is_fresh(CacheEntry *entry, const char *source_path, unsigned long generation,
+                           uint64_t deps_hash);
+static CacheResult insert_and_ref(const char *source_path, const char *cache_key, CacheKeyKind kind,
+                                  CacheBody *bodies, const CacheFileMeta *meta, unsigned long generation);
+static CacheResult load_or_generate(const char *source_path, const char *cache_key, CacheKeyKind kind,
+                                    const CacheVersion *version, unsigned long generation,
+                                    content_generator_t generator);
+static CacheResult insert_from_disk(const char *source_path, const char *cache_key, CacheKeyKind kind,
+                                    CacheBody *bodies, const CacheFileMeta *meta, unsigned long generation);
+static uint64_t hash_source_file(const char *source_path);
+static bool load_variant(const char *cache_key, ContentEncoding encoding, const CacheFileMeta *meta,
+                         CacheBody *body);
+static bool inflight_find(const char *key, const CacheVersion *version);
+static bool may_serve_stale(CacheEntry *entry);
 
-CacheResult get_cached_or_generate(const char *source_path, content_generator_t generator) {
-    CacheResult result = { .content = NULL, .size = 0, .etag = NULL, .last_modified = 0 };
-    ensure_cache_dir_exists();
+CacheResult get_cached_or_generate(const char *source_path, const CacheDeps *deps, content_generator_t generator) {
+    CacheResult result = { 0 };
 
-    char cache_path[PATH_MAX];
-    char relative_source_path[PATH_MAX];
-    if (strstr(source_path, g_project_root) == source_path) {
-        snprintf(relative_source_path, sizeof(relative_source_path), "%s", source_path + strlen(g_project_root));
-    } else {
-        snprintf(relative_source_path, sizeof(relative_source_path), "%s", source_path);
+    // Capture the generation before looking at the file, so that a change made
+    // while we validate is still seen by the next request.
+    unsigned long generation = watcher_generation();
+    uint64_t deps_hash = dependency_hash(deps);
+    pthread_mutex_lock(&s_mem_cache.lock);
+    CacheEntry *entry = mem_cache_find(source_path);
+    if (entry && entry_is_fresh(entry, source_path, generation, deps_hash)) {
+        result = result_from_entry(entry);
     }
-    for (char *p = relative_source_path; *p; p++) {
-        if (*p == '/' || *p == '\\') *p = '_';
-    }
-    snprintf(cache_path, sizeof(cache_path), "%s/cache/%s.gz", g_project_root, relative_source_path);
+    pthread_mutex_unlock(&s_mem_cache.lock);
+    if (result.entry) return result;
 
-    time_t source_mtime = get_mtime(source_path);
-    if (source_mtime == -1) {
-        fprintf(stderr, "Error: Cannot get modification time for source file %s\n", source_path);
+    CacheVersion version;
+    if (!get_source_version(source_path, &version)) {
+        pthread_mutex_lock(&s_mem_cache.lock);
+        if ((entry = mem_cache_find(source_path)) != NULL) mem_cache_remove(entry);
+        pthread_mutex_unlock(&s_mem_cache.lock);
+        result.error = errno;
+        // Missing files are routine (mistyped links, scanners); only report real errors
+        if (result.error != ENOENT) {
+            fprintf(stderr, "Error: Cannot get modification time for source file %s\n", source_path);
+        }
         return result;
     }
-    result.last_modified = source_mtime;
+    version.deps_hash = deps_hash;
 
-    char etag_buffer[64];
-    snprintf(etag_buffer, sizeof(etag_buffer), "\"%lx\"", (unsigned long)source_mtime);
-    result.etag = strdup(etag_buffer);
-    if (!result.etag) {
-        return result;
+    CacheKeyKind kind;
+    const char *cache_key = source_cache_key(source_path, &kind);
+    return lookup_or_generate(source_path, cache_key, kind, &version, generation, generator);
+}
+
+CacheResult get_cached_or_generate_version(
+    const char *source_path,
+    const char *cache_key,
+    time_t mtime,
+    uint64_t generation,
+    const CacheDeps *deps,
+    content_generator_t generator
+) {
+    CacheVersion source = { .mtime = mtime, .generation = generation, .deps_hash = dependency_hash(deps) };
+    return lookup_or_generate(source_path, cache_key, CACHE_KEY_NAMED, &source, watcher_generation(), generator);
+}
+
+CacheResult get_cached(const char *source_path, const CacheDeps *deps) {
+    CacheResult result = { 0 };
+
+    unsigned long generation = watcher_generation();
+    uint64_t deps_hash = dependency_hash(deps);
+    pthread_mutex_lock(&s_mem_cache.lock);
+    CacheEntry *entry = mem_cache_find(source_path);
+    if (entry && entry_is_fresh(entry, source_path, generation, deps_hash)) {
+        result = result_from_entry(entry);
+    }
+    pthread_mutex_unlock(&s_mem_cache.lock);
+    if (result.entry || !entry) return result;
+
+    // The entry may still match the source; a stat is cheap enough for the event loop
+    CacheVersion version;
+    bool exists = get_source_version(source_path, &version);
+    version.deps_hash = deps_hash;
+    pthread_mutex_lock(&s_mem_cache.lock);
+    entry = mem_cache_find(source_path);
+    if (entry && exists && version_equal(&entry->meta.source, &version)) {
+        entry->validated_generation = generation;
+        result = result_from_entry(entry);
+    } else if (entry && exists && may_serve_stale(entry)) {
+        result = result_from_entry(entry);
+        result.is_stale = true;
+    }
+    pthread_mutex_unlock(&s_mem_cache.lock);
+    return result;
+}
+
+CacheResult get_cached_version(const char *source_path, time_t mtime, uint64_t generation,
+                               const CacheDeps *deps) {
+    CacheResult result = { 0 };
+    uint64_t deps_hash = dependency_hash(deps);
+    pthread_mutex_lock(&s_mem_cache.lock);
+    CacheEntry *entry = mem_cache_find(source_path);
+    if (entry && entry->meta.source.mtime == mtime && entry->meta.source.generation == generation &&
+        entry->meta.source.deps_hash == deps_hash) {
+        result = result_from_entry(entry);
+    } else if (entry && may_serve_stale(entry)) {
+        result = result_from_entry(entry);
+        result.is_stale = true;
+    }
+    pthread_mutex_unlock(&s_mem_cache.lock);
+    return result;
+}
+
+void cache_init_disk(size_t max_bytes) {
+    char cache_dir[PATH_MAX];
+    snprintf(cache_dir, sizeof(cache_dir), "%s/cache", g_project_root);
+    mkdir(cache_dir, 0755);
+    if (!disk_cache_open(cache_dir, max_bytes, cache_file_is_orphan)) {
+        perror("disk cache");
+    }
+}
+
+void cache_attach_gzip(char *gzip, size_t gzip_size) {
+    free(t_attached_gzip.data);
+    t_attached_gzip.data = gzip;
+    t_attached_gzip.size = gzip_size;
+}
+
+void cache_set_stale_window(int seconds) {
+    s_mem_cache.stale_window = seconds;
+}
+
+unsigned cache_result_encodings(const CacheResult *result) {
+    unsigned mask = 1u << ENCODING_IDENTITY;  // Can always be produced by inflating
+    pthread_mutex_lock(&s_mem_cache.lock);  // Bodies may be added in the background
+    for (int enc = 0; result->entry && enc < ENCODING_COUNT; enc++) {
+        if (result->entry->bodies[enc].data) mask |= 1u << enc;
+    }
+    pthread_mutex_unlock(&s_mem_cache.lock);
+    return mask;
+}
+
+bool cache_result_select(CacheResult *result, ContentEncoding encoding) {
+    CacheEntry *entry = result->entry;
+    if (!entry) return false;
+
+    pthread_mutex_lock(&s_mem_cache.lock);
+    char *body = entry->bodies[encoding].data;
+    pthread_mutex_unlock(&s_mem_cache.lock);
+
+    if (!body && encoding == ENCODING_IDENTITY) {
+        // Inflate once and keep the result, so identity clients don't pay for it again
+        CacheBody *gzip = &entry->bodies[ENCODING_GZIP];
+        size_t size = 0;
+        char *inflated = gzip_decompress(gzip->data, gzip->size, entry->meta.content_size, &size);
+        if (!inflated) return false;
+        pthread_mutex_lock(&s_mem_cache.lock);
+        if (entry->bodies[ENCODING_IDENTITY].data) {
+            free(inflated);  // Another thread got there first
+        } else {
+            entry->bodies[ENCODING_IDENTITY].data = inflated;
+            entry->bodies[ENCODING_IDENTITY].size = size;
+            if (entry->in_table) {
+                s_mem_cache.total_bytes += size;
+                evict_over_budget(entry);
+            }
+        }
+        body = entry->bodies[ENCODING_IDENTITY].data;
+        pthread_mutex_unlock(&s_mem_cache.lock);
+    }
+    if (!body) return false;
+
+    // Bodies are never replaced once published, so they can be read without the lock
+    result->content = body;
+    result->size = entry->bodies[encoding].size;
+    result->encoding = encoding;
+    result->etag = entry->etags[encoding];
+    return true;
+}
+
+int cache_result_open(const CacheResult *result, off_t *offset) {
+    CacheEntry *entry = result->entry;
+    if (!entry || !result->content) return -1;
+
+    pthread_mutex_lock(&s_mem_cache.lock);
+    ino_t file_id = entry->bodies[result->encoding].file_id;
+    off_t body_offset = entry->bodies[result->encoding].offset;
+    pthread_mutex_unlock(&s_mem_cache.lock);
+    if (file_id == 0) return -1;  // Only kept in memory, e.g. the identity body
+
+    char path[PATH_MAX];
+    cache_file_path(entry->cache_key, result->encoding, path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    // Cache files are replaced by rename(), so a file with the same inode still
+    // holds the body we loaded
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_ino != file_id || (size_t)st.st_size != body_offset + result->size) {
+        close(fd);
+        return -1;
+    }
+    *offset = body_offset;
+    return fd;
+}
+
+void release_cache_result(CacheResult result) {
+    if (!result.entry) return;
+    pthread_mutex_lock(&s_mem_cache.lock);
+    entry_unref(result.entry);
+    pthread_mutex_unlock(&s_mem_cache.lock);
+}
+
+// Returns the entry for `source_path` if it was built from `version`, falling
+// back to the disk cache and finally to the generator.
+static CacheResult lookup_or_generate(
+    const char *source_path,
+    const char *cache_key,
+    CacheKeyKind kind,
+    const CacheVersion *version,
+    unsigned long generation,
+    content_generator_t generator
+) {
+    CacheResult result = { 0 };
+    InflightLoad load = { .key = source_path, .version = version };
+
+    pthread_mutex_lock(&s_mem_cache.lock);
+    for (;;) {
+        CacheEntry *entry = mem_cache_find(source_path);
+        if (entry && version_equal(&entry->meta.source, version)) {
+            entry->validated_generation = generation;
+            result = result_from_entry(entry);
+            break;
+        }
+        // Single flight: if another thread is already loading this version, wait
+        // for it and take its result instead of rendering and writing it again
+        if (!inflight_find(source_path, version)) {
+            load.next = s_mem_cache.inflight;
+            s_mem_cache.inflight = &load;
+            break;
+        }
+        pthread_cond_wait(&s_mem_cache.load_done, &s_mem_cache.lock);
     }
+    pthread_mutex_unlock(&s_mem_cache.lock);
+    if (result.entry) return result;
+
+    result = load_or_generate(source_path, cache_key, kind, version, generation, generator);
+    if (!result.entry) result.error = EIO;
+
+    pthread_mutex_lock(&s_mem_cache.lock);
+    InflightLoad **pp = &s_mem_cache.inflight;
+    while (*pp != &load) pp = &(*pp)->next;
+    *pp = load.next;
+    pthread_cond_broadcast(&s_mem_cache.load_done);
+    pthread_mutex_unlock(&s_mem_cache.lock);
+    return result;
+}
+
+// Loads `version` of the content from the disk cache, or generates and stores it.
+// Every encoding is kept in its own cache file under `cache_key`.
+static CacheResult load_or_generate(
+    const char *source_path,
+    const char *cache_key,
+    CacheKeyKind kind,
+    const CacheVersion *version,
+    unsigned long generation,
+    content_generator_t generator
+) {
+    CacheResult result = { 0 };
+    CacheBody bodies[ENCODING_COUNT] = { 0 };
+    CacheFileMeta meta = { 0 };
 
-    time_t cache_mtime = get_mtime(cache_path);
+    // The header has everything needed to serve the entry, so a hit costs one mmap()
+    if (cache_file_map(cache_key, ENCODING_GZIP, version, &bodies[ENCODING_GZIP], &meta)) {
+        return insert_from_disk(source_path, cache_key, kind, bodies, &meta, generation);
+    }
 
-    if (cache_mtime != -1 && cache_mtime >= source_mtime) {
-        size_t cached_size;
-        char *cached_content = read_file_content(cache_path, &cached_size);
-        if (cached_content) {
-            result.content = cached_content;
-            result.size = cached_size;
-            return result;
+    // Editors, checkouts and rsync change mtimes without changing the bytes. If
+    // the source still hashes the same, only record its new version
+    uint64_t source_hash = 0;
+    if (kind == CACHE_KEY_SOURCE) {
+        source_hash = hash_source_file(source_path);
+        if (source_hash != 0 && cache_file_map(cache_key, ENCODING_GZIP, NULL, &bodies[ENCODING_GZIP], &meta)) {
+            bool unchanged = meta.source_hash == source_hash && meta.source.deps_hash == version->deps_hash;
+            cache_body_free(&bodies[ENCODING_GZIP]);
+            if (unchanged) {
+                // Last-Modified follows the new mtime, like the If-Modified-Since check
+                char last_modified[sizeof(meta.last_modified)];
+                format_http_date(version->mtime, last_modified, sizeof(last_modified));
+                cache_file_restamp(cache_key, version, last_modified);
+                if (cache_file_map(cache_key, ENCODING_GZIP, version, &bodies[ENCODING_GZIP], &meta)) {
+                    return insert_from_disk(source_path, cache_key, kind, bodies, &meta, generation);
+                }
+            }
         }
     }
 
     size_t content_size = 0;
     char *content = generator(source_path, &content_size);
+    CacheBody attached_gzip = t_attached_gzip;
+    memset(&t_attached_gzip, 0, sizeof(t_attached_gzip));
     if (!content) {
-        free_cache_result(result);
-        result.etag = NULL;
+        free(attached_gzip.data);
         return result;
     }
 
-    size_t compressed_size = 0;
-    char *compressed_content = gzip_compress(content, content_size, &compressed_size);
+    meta.source = *version;
+    meta.source_hash = source_hash;
+    meta.content_hash = hash64(content, content_size);
+    meta.content_size = content_size;
+    // Derive the ETag from the bytes, not the mtime, so that a touch or a fresh
+    // checkout doesn't invalidate clients and all servers agree on it
+    snprintf(meta.etag, sizeof(meta.etag), "\"%016llx\"", (unsigned long long)meta.content_hash);
+    format_http_date(version->mtime, meta.last_modified, sizeof(meta.last_modified));
+
+    if (attached_gzip.data) {
+        bodies[ENCODING_GZIP] = attached_gzip;
+    } else {
+        bodies[ENCODING_GZIP].data = gzip_compress(content, content_size, &bodies[ENCODING_GZIP].size);
+    }
+#ifdef HAVE_ZSTD
+    bodies[ENCODING_ZSTD].data = zstd_compress(content, content_size, &bodies[ENCODING_ZSTD].size);
+#endif
     free(content);
 
-    if (!compressed_content) {
-        free_cache_result(result);
-        result.etag = NULL;
+    if (!bodies[ENCODING_GZIP].data) {
+        for (int enc = 0; enc < ENCODING_COUNT; enc++) cache_body_free(&bodies[enc]);
         return result;
     }
 
-    FILE *fp = fopen(cache_path, "wb");
-    if (fp) {
-        fwrite(compressed_content, 1, compressed_size, fp);
-        fclose(fp);
+    for (int enc = 0; enc < ENCODING_COUNT; enc++) {
+        if (bodies[enc].data) cache_file_store(cache_key, kind, (ContentEncoding)enc, &meta, &bodies[enc]);
+    }
+
+    return insert_and_ref(source_path, cache_key, kind, bodies, &meta, generation);
+}
+
+// Completes an entry whose gzip body was mapped from disk with its other
+// encodings and publishes it.
+static CacheResult insert_from_disk(const char *source_path, const char *cache_key, CacheKeyKind kind,
+                                    CacheBody *bodies, const CacheFileMeta *meta, unsigned long generation) {
+    for (int enc = ENCODING_GZIP + 1; enc < ENCODING_COUNT; enc++) {
+        load_variant(cache_key, (ContentEncoding)enc, meta, &bodies[enc]);
+    }
+#ifdef HAVE_ZSTD
+    if (!bodies[ENCODING_ZSTD].data) rebuild_zstd_variant(cache_key, kind, meta, bodies);
+#endif
+    return insert_and_ref(source_path, cache_key, kind, bodies, meta, generation);
+}
+
+// Returns hash64() of a source file's bytes, or 0 if it can't be read.
+static uint64_t hash_source_file(const char *source_path) {
+    size_t size = 0;
+    char *bytes = read_file_content(source_path, &size);
+    if (!bytes) return 0;
+    uint64_t hash = hash64(bytes, size);
+    free(bytes);
+    return hash;
+}
+
+// Maps the cache file of another encoding of the entry described by `meta`.
+// Files left over from an earlier render of the same source are rejected.
+static bool load_variant(const char *cache_key, ContentEncoding encoding, const CacheFileMeta *meta,
+                         CacheBody *body) {
+    CacheFileMeta variant_meta;
+    if (!cache_file_map(cache_key, encoding, &meta->source, body, &variant_meta)) return false;
+    if (variant_meta.content_hash == meta->content_hash && variant_meta.content_size == meta->content_size) {
+        return true;
     }
+    cache_body_free(body);
+    return false;
+}
+
+// Publishes freshly loaded content and returns a reference to it.
+static CacheResult insert_and_ref(const char *source_path, const char *cache_key, CacheKeyKind kind,
+                                  CacheBody *bodies, const CacheFileMeta *meta, unsigned long generation) {
+    CacheResult result = { 0 };
+    pthread_mutex_lock(&s_mem_cache.lock);
+    CacheEntry *entry = mem_cache_insert(source_path, cache_key, kind, bodies, meta, generation);
+    if (entry) result = result_from_entry(entry);
+    pthread_mutex_unlock(&s_mem_cache.lock);
 
-    result.content = compressed_content;
-    result.size = compressed_size;
+#ifdef HAVE_BROTLI
+    // Brotli at maximum quality is too slow for the request path: serve gzip
+    // now and add the .br body once the background thread has produced it
+    if (result.entry && !result.entry->bodies[ENCODING_BROTLI].data) {
+        render_pool_submit_background(source_path, brotli_job);
+    }
+#endif
     return result;
 }
 
-void free_cache_result(CacheResult result) {
-    if (result.content) free(result.content);
-    if (result.etag) free(result.etag);
+// With the watcher running, an entry is fresh if neither its source nor any
+// parent directory changed since the entry was last validated.
+static bool entry_is_fresh(CacheEntry *entry, const char *source_path, unsigned long generation,
+                           uint64_t deps_hash) {
+    if (!watcher_is_active() || entry->meta.source.deps_hash != deps_hash) return false;
+    if (entry->validated_generation == generation) return true;
+    if (watcher_path_generation(source_path) > entry->validated_generation) return false;
+    entry->validated_generation = generation;
+    return true;
 }
 
-static void ensure_cache_dir_exists() {
-    char cache_dir_path[PATH_MAX];
-    snprintf(cache_dir_path, sizeof(cache_dir_path), "%s/cache", g_project_root);
-    struct stat st = {0};
-    if (stat(cache_dir_path, &st) == -1) {
-        mkdir(cache_dir_path, 0755);
+// --- Memory cache ---
+
+// Stale-while-revalidate: an outdated entry may be served for up to
+// stale_window seconds after it was first found to be outdated.
+static bool may_serve_stale(CacheEntry *entry) {
+    if (s_mem_cache.stale_window <= 0) return false;
+    time_t now = time(NULL);
+    if (entry->stale_since == 0) entry->stale_since = now;
+    return now - entry->stale_since <= s_mem_cache.stale_window;
+}
+
+static bool inflight_find(const char *key, const CacheVersion *version) {
+    for (InflightLoad *load = s_mem_cache.inflight; load; load = load->next) {
+        if (version_equal(load->version, version) && strcmp(load->key, key) == 0) return true;
     }
+    return false;
 }
 
-static time_t get_mtime(const char *path) {
+static void lru_unlink(CacheEntry *entry) {
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else s_mem_cache.lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else s_mem_cache.lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(CacheEntry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = s_mem_cache.lru_head;
+    if (s_mem_cache.lru_head) s_mem_cache.lru_head->lru_prev = entry;
+    s_mem_cache.lru_head = entry;
+    if (!s_mem_cache.lru_tail) s_mem_cache.lru_tail = entry;
+}
+
+static CacheEntry* mem_cache_find(const char *key) {
+    CacheEntry *entry = s_mem_cache.buckets[hash_string(key) & (MEM_CACHE_BUCKETS - 1)];
+    for (; entry; entry = entry->hash_next) {
+        if (strcmp(entry->key, key) == 0) {
+            lru_unlink(entry);
+            lru_push_front(entry);
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Unlinks an entry from the table. It is freed once the last reference is gone.
+static void mem_cache_remove(CacheEntry *entry) {
+    CacheEntry **pp = &s_mem_cache.buckets[hash_string(entry->key) & (MEM_CACHE_BUCKETS - 1)];
+    while (*pp && *pp != entry) pp = &(*pp)->hash_next;
+    if (*pp) *pp = entry->hash_next;
+    lru_unlink(entry);
+    s_mem_cache.total_bytes -= entry_bytes(entry);
+    entry->in_table = false;
+    entry_unref(entry);
+}
+
+// Takes ownership of `bodies`, which are freed on failure. The gzip body must be set.
+static CacheEntry* mem_cache_insert(const char *key, const char *cache_key, CacheKeyKind kind,
+                                    CacheBody *bodies, const CacheFileMeta *meta, unsigned long generation) {
+    CacheEntry *old = mem_cache_find(key);
+    if (old) mem_cache_remove(old);
+
+    CacheEntry *entry = calloc(1, sizeof(*entry));
+    if (!entry || !(entry->key = strdup(key)) || !(entry->cache_key = strdup(cache_key))) {
+        if (entry) free(entry->key);
+        free(entry);
+        for (int enc = 0; enc < ENCODING_COUNT; enc++) cache_body_free(&bodies[enc]);
+        return NULL;
+    }
+    entry->key_kind = kind;
+    memcpy(entry->bodies, bodies, sizeof(entry->bodies));
+    entry->meta = *meta;
+    entry->validated_generation = generation;
+    // Each encoding is a separate representation: insert a suffix before the closing quote
+    size_t etag_len = strlen(meta->etag);
+    for (int enc = 0; enc < ENCODING_COUNT; enc++) {
+        snprintf(entry->etags[enc], sizeof(entry->etags[enc]), "%.*s%s\"", (int)(etag_len ? etag_len - 1 : 0),
+                 meta->etag, encoding_etag_suffix((ContentEncoding)enc));
+    }
+
+    unsigned long bucket = hash_string(key) & (MEM_CACHE_BUCKETS - 1);
+    entry->hash_next = s_mem_cache.buckets[bucket];
+    s_mem_cache.buckets[bucket] = entry;
+    entry->in_table = true;
+    entry->refcount = 1;
+    lru_push_front(entry);
+    s_mem_cache.total_bytes += entry_bytes(entry);
+    evict_over_budget(entry);
+    return entry;
+}
+
+// Evicts from the cold end until the cache is within its budget, but never
+// `keep`, the entry that just grew. Called with the lock held.
+static void evict_over_budget(CacheEntry *keep) {
+    CacheEntry *victim = s_mem_cache.lru_tail;
+    while (s_mem_cache.total_bytes > MEM_CACHE_MAX_BYTES && victim) {
+        CacheEntry *prev = victim->lru_prev;
+        if (victim != keep) mem_cache_remove(victim);
+        victim = prev;
+    }
+}
+
+static size_t entry_bytes(const CacheEntry *entry) {
+    size_t total = 0;
+    for (int enc = 0; enc < ENCODING_COUNT; enc++) total += entry->bodies[enc].size;
+    return total;
+}
+
+static const char *encoding_etag_suffix(ContentEncoding encoding) {
+    switch (encoding) {
+        case ENCODING_GZIP: return "-gzip";
+        case ENCODING_ZSTD: return "-zstd";
+        case ENCODING_BROTLI: return "-br";
+        default: return "";
+    }
+}
+
+static void entry_unref(CacheEntry *entry) {
+    if (--entry->refcount > 0) return;
+    for (int enc = 0; enc < ENCODING_COUNT; enc++) cache_body_free(&entry->bodies[enc]);
+    free(entry->cache_key);
+    free(entry->key);
+    free(entry);
+}
+
+static CacheResult result_from_entry(CacheEntry *entry) {
+    entry->refcount++;
+    CacheResult result = {
+        .content = entry->bodies[ENCODING_GZIP].data,
+        .size = entry->bodies[ENCODING_GZIP].size,
+        .encoding = ENCODING_GZIP,
+        .etag = entry->etags[ENCODING_GZIP],
+        .last_modified_str = entry->meta.last_modified,
+        .last_modified = entry->meta.source.mtime,
+        .entry = entry,
+    };
+    return result;
+}
+
+// --- Disk cache and compression ---
+
+static bool get_source_version(const char *path, CacheVersion *version) {
     struct stat st;
-    if (stat(path, &st) == 0) {
-        return st.st_mtime;
+    if (stat(path, &st) != 0) return false;
+    version->mtime = st.st_mtime;
+    version->size = st.st_size;
+    version->inode = st.st_ino;
+    version->generation = 0;            // Only content built from the md/ tree has one
+    return true;
+}
+
+// Size and inode (or the generation of content built from several files)
+// catch rewrites within the mtime's one-second granularity.
+static bool version_equal(const CacheVersion *a, const CacheVersion *b) {
+    return a->mtime == b->mtime && a->size == b->size && a->inode == b->inode &&
+           a->generation == b->generation && a->deps_hash == b->deps_hash;
+}
+
+// Combines the template's bytes and the renderer into one value for CacheVersion.
+static uint64_t dependency_hash(const CacheDeps *deps) {
+    uint64_t parts[2] = { 0, deps->renderer };
+    if (deps->template_path) parts[0] = template_hash(deps->template_path);
+    return hash64(parts, sizeof(parts));
+}
+
+// Returns hash64() of a template, 0 if it can't be read. Templates are only
+// read again after the watcher reported a change, or without the watcher,
+// after stat() shows a different file.
+static uint64_t template_hash(const char *template_path) {
+    unsigned long generation = watcher_generation();
+    pthread_mutex_lock(&s_templates.lock);
+    TemplateRecord *rec = s_templates.records;
+    while (rec && strcmp(rec->path, template_path) != 0) rec = rec->next;
+    if (rec && watcher_is_active() && (rec->validated_generation == generation ||
+                                       watcher_path_generation(template_path) <= rec->validated_generation)) {
+        rec->validated_generation = generation;
+        uint64_t hash = rec->hash;
+        pthread_mutex_unlock(&s_templates.lock);
+        return hash;
+    }
+
+    CacheVersion version = { 0 };
+    get_source_version(template_path, &version);
+    uint64_t hash = rec ? rec->hash : 0;
+    if (!rec || !version_equal(&rec->version, &version)) {
+        hash = hash_source_file(template_path);
+        if (!rec && (rec = calloc(1, sizeof(*rec))) != NULL) {
+            if ((rec->path = strdup(template_path)) == NULL) {
+                free(rec);
+                rec = NULL;
+            } else {
+                rec->next = s_templates.records;
+                s_templates.records = rec;
+            }
+        }
+    }
+    if (rec) {
+        rec->version = version;
+        rec->hash = hash;
+        rec->validated_generation = generation;
     }
-    return -1;
+    pthread_mutex_unlock(&s_templates.lock);
+    return hash;
+}
+
+// Sources below the project root are keyed by their relative path ("md/a/b.md"),
+// which lets the startup scan tell whether the source still exists.
+static const char *source_cache_key(const char *source_path, CacheKeyKind *kind) {
+    size_t root_len = strlen(g_project_root);
+    if (strncmp(source_path, g_project_root, root_len) == 0 && source_path[root_len] == '/') {
+        *kind = CACHE_KEY_SOURCE;
+        return source_path + root_len + 1;
+    }
+    *kind = CACHE_KEY_NAMED;
+    return source_path;
 }
 
 static char* gzip_compress(const char *data, size_t data_len, size_t *compressed_size) {
@@ -112,7 +735,7 @@ static char* gzip_compress(const char *data, size_t data_len, size_t *compressed
     strm.zalloc = Z_NULL;
     strm.zfree = Z_NULL;
     strm.opaque = Z_NULL;
-    
+
     size_t buffer_size = data_len + 12 + (data_len / 1000) + 5;
     unsigned char *out_buffer = malloc(buffer_size);
     if (!out_buffer) return NULL;
@@ -137,3 +760,127 @@ static char* gzip_compress(const char *data, size_t data_len, size_t *compressed
     deflateEnd(&strm);
     return (char *)out_buffer;
 }
+
+// `size_hint` is the expected output size, 0 if unknown.
+static char* gzip_decompress(const char *data, size_t data_len, size_t size_hint, size_t *size) {
+    z_stream strm = {0};
+    if (inflateInit2(&strm, 15 + 16) != Z_OK) return NULL;
+
+    size_t capacity = size_hint ? size_hint : data_len * 4 + 64;
+    char *out = malloc(capacity + 1);
+    if (!out) {
+        inflateEnd(&strm);
+        return NULL;
+    }
+
+    strm.next_in = (Bytef *)data;
+    strm.avail_in = data_len;
+    int ret;
+    do {
+        if (strm.total_out == capacity) {
+            char *bigger = realloc(out, capacity * 2 + 1);
+            if (!bigger) break;
+            out = bigger;
+            capacity *= 2;
+        }
+        strm.next_out = (Bytef *)out + strm.total_out;
+        strm.avail_out = capacity - strm.total_out;
+        ret = inflate(&strm, Z_NO_FLUSH);
+    } while (ret == Z_OK);
+
+    if (ret != Z_STREAM_END) {
+        inflateEnd(&strm);
+        free(out);
+        return NULL;
+    }
+    *size = strm.total_out;
+    out[*size] = '\0';
+    inflateEnd(&strm);
+    return out;
+}
+
+#ifdef HAVE_ZSTD
+static char* zstd_compress(const char *data, size_t data_len, size_t *compressed_size) {
+    size_t bound = ZSTD_compressBound(data_len);
+    char *out = malloc(bound);
+    if (!out) return NULL;
+
+    size_t n = ZSTD_compress(out, bound, data, data_len, ZSTD_COMPRESSION_LEVEL);
+    if (ZSTD_isError(n)) {
+        fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(n));
+        free(out);
+        return NULL;
+    }
+    *compressed_size = n;
+    return out;
+}
+
+// Adds the zstd body for a gzip entry read from disk whose zstd file is missing
+// or outdated, e.g. because it was written by a build without zstd.
+static void rebuild_zstd_variant(const char *cache_key, CacheKeyKind kind, const CacheFileMeta *meta,
+                              CacheBody *bodies) {
+    size_t size = 0;
+    char *content = gzip_decompress(bodies[ENCODING_GZIP].data, bodies[ENCODING_GZIP].size, meta->content_size, &size);
+    if (!content) return;
+    bodies[ENCODING_ZSTD].data = zstd_compress(content, size, &bodies[ENCODING_ZSTD].size);
+    free(content);
+    if (bodies[ENCODING_ZSTD].data) cache_file_store(cache_key, kind, ENCODING_ZSTD, meta, &bodies[ENCODING_ZSTD]);
+}
+#endif
+
+#ifdef HAVE_BROTLI
+static char* brotli_compress(const char *data, size_t data_len, size_t *compressed_size) {
+    size_t size = BrotliEncoderMaxCompressedSize(data_len);
+    if (size == 0) return NULL;
+    uint8_t *out = malloc(size);
+    if (!out) return NULL;
+
+    if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                               data_len, (const uint8_t *)data, &size, out)) {
+        free(out);
+        return NULL;
+    }
+    *compressed_size = size;
+    return (char *)out;
+}
+
+// Background job: adds the Brotli body to the current entry for `key` and
+// stores it with the entry's other cache files.
+static int brotli_job(const char *key) {
+    pthread_mutex_lock(&s_mem_cache.lock);
+    CacheEntry *entry = mem_cache_find(key);
+    if (entry && entry->bodies[ENCODING_BROTLI].data) entry = NULL;
+    if (entry) entry->refcount++;
+    pthread_mutex_unlock(&s_mem_cache.lock);
+    if (!entry) return 200;
+
+    CacheBody br = { 0 };
+    size_t size = 0;
+    char *content = gzip_decompress(entry->bodies[ENCODING_GZIP].data, entry->bodies[ENCODING_GZIP].size,
+                                    entry->meta.content_size, &size);
+    if (content) br.data = brotli_compress(content, size, &br.size);
+    free(content);
+
+    // Don't store anything for an entry that was replaced by a newer version meanwhile
+    pthread_mutex_lock(&s_mem_cache.lock);
+    bool current = entry->in_table;
+    pthread_mutex_unlock(&s_mem_cache.lock);
+    if (br.data && current) {
+        cache_file_store(entry->cache_key, entry->key_kind, ENCODING_BROTLI, &entry->meta, &br);
+    }
+
+    bool published = false;
+    pthread_mutex_lock(&s_mem_cache.lock);
+    if (br.data && entry->in_table && !entry->bodies[ENCODING_BROTLI].data) {
+        entry->bodies[ENCODING_BROTLI] = br;
+        s_mem_cache.total_bytes += br.size;
+        evict_over_budget(entry);
+        published = true;
+    }
+    entry_unref(entry);
+    pthread_mutex_unlock(&s_mem_cache.lock);
+
+    if (!published) cache_body_free(&br);
+    return published ? 200 : 500;
+}
+#endif
@@ -3,16 +3,42 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
+#include <sys/types.h>
+
+/**
+ * @brief The content encodings a cached page can be served with.
+ */
+typedef enum {
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODING_ZSTD,      // Only produced when built with HAVE_ZSTD
+    ENCODING_BROTLI,    // Only produced when built with HAVE_BROTLI, in the background
+    ENCODING_COUNT
+} ContentEncoding;
+
+/**
+ * @brief A memory-resident cache entry. Opaque outside of cache.c.
+ */
+typedef struct CacheEntry CacheEntry;
 
 /**
  * @brief A structure to hold the result of a cache retrieval or generation.
+ *
+ * The pointers reference storage owned by a memory cache entry. They stay valid
+ * until the result is released with release_cache_result().
  */
 typedef struct {
-    char *content;          // Pointer to the (compressed) content buffer
-    size_t size;            // Size of the content buffer
-    char *etag;             // A unique identifier for the content (e.g., based on timestamp)
-    time_t last_modified;   // The modification timestamp of the source file
+    const char *content;            // Pointer to the content buffer in the selected encoding
+    size_t size;                    // Size of the content buffer
+    ContentEncoding encoding;       // The selected encoding, gzip unless changed with cache_result_select()
+    const char *etag;               // A unique identifier for this representation (e.g., based on timestamp)
+    const char *last_modified_str;  // Preformatted HTTP date for the Last-Modified header
+    time_t last_modified;           // The modification timestamp of the source file
+    bool is_stale;                  // An outdated entry served while a new version is rendered
+    int error;                      // Why `entry` is NULL: ENOENT if the source doesn't exist, else EIO
+    CacheEntry *entry;              // The referenced entry, NULL on error
 } CacheResult;
 
 
@@ -21,23 +47,157 @@ typedef struct {
  */
 typedef char* (*content_generator_t)(const char *source_path, size_t *content_size);
 
+/**
+ * @brief Everything besides its sources that a page is built from.
+ *
+ * Recorded with every cache entry, so that a template edit or a renderer
+ * upgrade invalidates exactly the entries built with the old one.
+ */
+typedef struct {
+    const char *template_path;      // Absolute path of the page template, NULL if none
+    unsigned long renderer;         // Renderer version and options, as chosen by the caller
+} CacheDeps;
+
 /**
  * @brief Retrieves compressed content from cache or generates it if missing/stale.
  *
+ * Lookups are served from an in-memory table first. While the file watcher is
+ * active, a memory hit needs no filesystem access at all. The on-disk cache is
+ * only consulted when the memory entry is missing or older than the source file
+ * or its dependencies.
+ * Concurrent callers missing on the same version share a single load: one of
+ * them renders, the others wait for its result.
+ *
  * @param source_path The absolute path to the original source file.
+ * @param deps What else the generator's output depends on.
  * @param generator A function pointer to the content generator.
- * @return A CacheResult struct. The pointers within the struct must be freed by the caller.
+ * @return A CacheResult struct. It must be released by the caller with release_cache_result().
  *         If an error occurs, the pointers in the returned struct will be NULL.
  */
 CacheResult get_cached_or_generate(
     const char *source_path,
+    const CacheDeps *deps,
     content_generator_t generator
 );
 
 /**
- * @brief Frees the memory allocated for a CacheResult's members.
+ * @brief Like get_cached_or_generate(), but for content whose version the caller determines.
+ *
+ * Used for pages built from many files (e.g. the index), where the source mtime alone
+ * does not say whether the cached copy is current.
+ *
+ * @param source_path The memory cache key, also passed to the generator.
+ * @param cache_key The name of the disk cache entry, e.g. "index"; see cache_file_path().
+ * @param mtime The latest mtime of the content's sources, sent as Last-Modified.
+ * @param generation The exact version the content must be built from; any change to the
+ *                   sources must change it, even within the same second. Entries built
+ *                   from another version (or mtime) are regenerated.
+ * @param deps What else the generator's output depends on.
+ * @param generator A function pointer to the content generator.
+ * @return A CacheResult struct, to be released with release_cache_result().
+ */
+CacheResult get_cached_or_generate_version(
+    const char *source_path,
+    const char *cache_key,
+    time_t mtime,
+    uint64_t generation,
+    const CacheDeps *deps,
+    content_generator_t generator
+);
+
+/**
+ * @brief Returns the memory cache entry for a source file if it is current.
+ *
+ * Never renders and never reads the disk cache, so it is safe to call from the
+ * event loop. At most one stat() is made, when the file watcher is not active
+ * or reported a change.
+ *
+ * With a stale window configured, an outdated entry is returned with `is_stale`
+ * set instead of a miss; the caller should serve it and schedule a re-render.
+ *
+ * @param source_path The absolute path to the original source file.
+ * @param deps The dependencies the entry must have been built with.
+ * @return A CacheResult to release with release_cache_result(). `entry` is NULL on a miss.
+ */
+CacheResult get_cached(const char *source_path, const CacheDeps *deps);
+
+/**
+ * @brief Returns the memory cache entry for `source_path` if it was built from `mtime` and `generation`.
+ *
+ * The non-blocking counterpart of get_cached_or_generate_version(). Outdated
+ * entries are returned with `is_stale` set, as with get_cached().
+ */
+CacheResult get_cached_version(const char *source_path, time_t mtime, uint64_t generation,
+                               const CacheDeps *deps);
+
+/**
+ * @brief Puts the disk cache under a size budget and removes orphaned entries.
+ *
+ * Call once at startup. Deletes the cache files of sources that no longer
+ * exist, e.g. after a post was deleted or renamed, and files left behind by
+ * older cache layouts. From then on, the least recently used cache files are
+ * deleted whenever the directory grows beyond `max_bytes`. Pages still held in
+ * memory keep working without their file.
+ *
+ * @param max_bytes The disk budget, 0 for no limit.
+ */
+void cache_init_disk(size_t max_bytes);
+
+/**
+ * @brief Hands the cache a ready-made gzip encoding of the content being generated.
+ *
+ * For generators that can produce gzip more cheaply than compressing their
+ * output, e.g. by stitching precompressed pieces. Call from within the
+ * generator, before it returns; the body is then used instead of compressing
+ * the returned content, and the cache takes ownership of it.
+ *
+ * @param gzip A complete gzip stream of exactly the returned content, allocated with malloc().
+ */
+void cache_attach_gzip(char *gzip, size_t gzip_size);
+
+/**
+ * @brief Enables stale-while-revalidate.
+ *
+ * Once an entry is found to be outdated, it may still be served for up to
+ * `seconds` while the new version is rendered in the background. After that,
+ * requests wait for the render again.
+ *
+ * @param seconds The maximum staleness window. 0 (the default) disables stale serving.
+ */
+void cache_set_stale_window(int seconds);
+
+/**
+ * @brief Returns the encodings a result can be served in, as a bit mask of (1 << ContentEncoding).
+ */
+unsigned cache_result_encodings(const CacheResult *result);
+
+/**
+ * @brief Points a result at the body and ETag of another encoding.
+ *
+ * The identity body is inflated from gzip the first time it is asked for and
+ * kept in the entry afterwards.
+ *
+ * @return false if the encoding is not available.
+ */
+bool cache_result_select(CacheResult *result, ContentEncoding encoding);
+
+/**
+ * @brief Opens the disk cache file that holds the selected body.
+ *
+ * Lets large bodies be sent with sendfile() instead of being copied into the
+ * connection's send buffer. Fails if the body is only kept in memory or the
+ * file was replaced since it was loaded.
+ *
+ * @param offset Receives the position of the body within the file, which
+ *               starts with a header.
+ * @return A read-only file descriptor the caller must close, or -1.
+ */
+int cache_result_open(const CacheResult *result, off_t *offset);
+
+/**
+ * @brief Drops the reference a CacheResult holds on its memory cache entry.
  */
-void free_cache_result(CacheResult result);
+void release_cache_result(CacheResult result);
 
 
 #endif // CACHE_H
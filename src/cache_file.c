@@ -0,0 +1,291 @@
+#include "cache_file.h"
+#include "utils.h"
+#include "disk_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define CACHE_FILE_MAGIC "MDCE"
+// Bump whenever CacheFileHeader changes. Files of other versions are misses
+// and get removed by the startup scan.
+#define CACHE_FILE_VERSION 5
+
+// Written in front of every cache file, followed by the key and then the body.
+// Files are only read back by the machine that wrote them, so fields are in
+// host byte order. The hashes stored in them don't depend on it (see hash64()),
+// so the ETags are the same on every host.
+typedef struct {
+    char magic[4];
+    uint16_t format_version;    // CACHE_FILE_VERSION
+    uint8_t key_kind;           // CacheKeyKind
+    uint8_t encoding;           // ContentEncoding of the body
+    int64_t source_mtime;
+    uint64_t source_size;
+    uint64_t source_inode;
+    uint64_t source_generation;
+    uint64_t source_hash;
+    uint64_t deps_hash;
+    uint64_t content_hash;
+    uint64_t content_size;
+    char etag[64];              // NUL-terminated
+    char last_modified[32];     // NUL-terminated
+    uint16_t key_len;           // Length of the key, which is not NUL-terminated
+    uint8_t reserved[6];
+} CacheFileHeader;
+
+// Forward declarations
+static bool write_cache_file(const char *path, const CacheFileHeader *hdr, const char *key,
+                             const char *body, size_t size);
+static bool header_is_valid(const CacheFileHeader *hdr, size_t file_size);
+static void make_parent_dirs(const char *path);
+static const char *encoding_extension(ContentEncoding encoding);
+
+void cache_file_path(const char *key, ContentEncoding encoding, char *out, size_t out_size) {
+    uint64_t digest = hash64(key, strlen(key));
+    snprintf(out, out_size, "%s/cache/%02x/%02x/%016llx%s", g_project_root,
+             (unsigned)(digest >> 56), (unsigned)(digest >> 48) & 0xff,
+             (unsigned long long)digest, encoding_extension(encoding));
+}
+
+bool cache_file_map(const char *key, ContentEncoding encoding, const CacheVersion *version,
+                    CacheBody *body, CacheFileMeta *meta) {
+    char path[PATH_MAX];
+    cache_file_path(key, encoding, path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(CacheFileHeader)) {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    // A different key means a hash collision or a foreign file: treat it as a miss
+    size_t map_size = (size_t)st.st_size;
+    CacheFileHeader hdr;
+    memcpy(&hdr, map, sizeof(hdr));
+    size_t key_len = strlen(key);
+    bool valid = header_is_valid(&hdr, map_size) && hdr.encoding == encoding &&
+                 hdr.key_len == key_len && memcmp((char *)map + sizeof(hdr), key, key_len) == 0;
+    if (valid && version) {
+        valid = hdr.source_mtime == (int64_t)version->mtime &&
+                hdr.source_size == (uint64_t)version->size &&
+                hdr.source_inode == (uint64_t)version->inode &&
+                hdr.source_generation == version->generation &&
+                hdr.deps_hash == version->deps_hash;
+    }
+    if (!valid) {
+        munmap(map, map_size);
+        return false;
+    }
+
+    size_t header_size = sizeof(hdr) + key_len;
+    body->map = map;
+    body->map_size = map_size;
+    body->data = (char *)map + header_size;
+    body->size = map_size - header_size;
+    body->offset = (off_t)header_size;
+    body->file_id = st.st_ino;
+
+    meta->source.mtime = (time_t)hdr.source_mtime;
+    meta->source.size = (off_t)hdr.source_size;
+    meta->source.inode = (ino_t)hdr.source_inode;
+    meta->source.generation = hdr.source_generation;
+    meta->source.deps_hash = hdr.deps_hash;
+    meta->source_hash = hdr.source_hash;
+    meta->content_hash = hdr.content_hash;
+    meta->content_size = (size_t)hdr.content_size;
+    memcpy(meta->etag, hdr.etag, sizeof(meta->etag));
+    memcpy(meta->last_modified, hdr.last_modified, sizeof(meta->last_modified));
+    disk_cache_touch(path);
+    return true;
+}
+
+void cache_file_store(const char *key, CacheKeyKind kind, ContentEncoding encoding,
+                      const CacheFileMeta *meta, CacheBody *body) {
+    size_t key_len = strlen(key);
+    if (key_len > UINT16_MAX) return;
+
+    CacheFileHeader hdr = {
+        .format_version = CACHE_FILE_VERSION,
+        .key_kind = (uint8_t)kind,
+        .encoding = (uint8_t)encoding,
+        .source_mtime = (int64_t)meta->source.mtime,
+        .source_size = (uint64_t)meta->source.size,
+        .source_inode = (uint64_t)meta->source.inode,
+        .source_generation = meta->source.generation,
+        .source_hash = meta->source_hash,
+        .deps_hash = meta->source.deps_hash,
+        .content_hash = meta->content_hash,
+        .content_size = (uint64_t)meta->content_size,
+        .key_len = (uint16_t)key_len,
+    };
+    memcpy(hdr.magic, CACHE_FILE_MAGIC, sizeof(hdr.magic));
+    snprintf(hdr.etag, sizeof(hdr.etag), "%s", meta->etag);
+    snprintf(hdr.last_modified, sizeof(hdr.last_modified), "%s", meta->last_modified);
+
+    char path[PATH_MAX];
+    cache_file_path(key, encoding, path, sizeof(path));
+    if (!write_cache_file(path, &hdr, key, body->data, body->size)) return;
+
+    CacheBody stored = { 0 };
+    CacheFileMeta stored_meta;
+    if (!cache_file_map(key, encoding, &meta->source, &stored, &stored_meta)) return;
+    if (stored.size != body->size) {
+        cache_body_free(&stored);
+        return;
+    }
+    free(body->data);
+    *body = stored;
+}
+
+void cache_file_restamp(const char *key, const CacheVersion *version, const char *last_modified) {
+    size_t key_len = strlen(key);
+    for (int enc = ENCODING_GZIP; enc < ENCODING_COUNT; enc++) {
+        char path[PATH_MAX];
+        cache_file_path(key, (ContentEncoding)enc, path, sizeof(path));
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+
+        struct stat st;
+        void *map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(CacheFileHeader)) {
+            map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (map == MAP_FAILED) continue;
+
+        // Other workers and processes map these files, so the header is never
+        // changed in place: a copy with the new header replaces the file, and
+        // readers see either the old or the new one
+        size_t map_size = (size_t)st.st_size;
+        CacheFileHeader hdr;
+        memcpy(&hdr, map, sizeof(hdr));
+        if (header_is_valid(&hdr, map_size) && hdr.encoding == enc && hdr.key_len == key_len &&
+            memcmp((char *)map + sizeof(hdr), key, key_len) == 0) {
+            hdr.source_mtime = (int64_t)version->mtime;
+            hdr.source_size = (uint64_t)version->size;
+            hdr.source_inode = (uint64_t)version->inode;
+            hdr.source_generation = version->generation;
+            snprintf(hdr.last_modified, sizeof(hdr.last_modified), "%s", last_modified);
+            size_t header_size = sizeof(hdr) + key_len;
+            if (!write_cache_file(path, &hdr, key, (char *)map + header_size, map_size - header_size)) {
+                perror("cache restamp");
+            }
+        }
+        munmap(map, map_size);
+    }
+}
+
+bool cache_file_is_orphan(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    CacheFileHeader hdr;
+    char key[PATH_MAX];
+    bool valid = fstat(fd, &st) == 0 &&
+                 pread(fd, &hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr) &&
+                 header_is_valid(&hdr, (size_t)st.st_size) &&
+                 hdr.key_len < sizeof(key) &&
+                 pread(fd, key, hdr.key_len, sizeof(hdr)) == (ssize_t)hdr.key_len;
+    close(fd);
+    if (!valid) return true;  // E.g. written by another version of the server
+    key[hdr.key_len] = '\0';
+
+    // A file that isn't where its key hashes to can never be found again
+    char expected[PATH_MAX];
+    cache_file_path(key, (ContentEncoding)hdr.encoding, expected, sizeof(expected));
+    if (strcmp(path, expected) != 0) return true;
+
+    if (hdr.key_kind == CACHE_KEY_SOURCE) {
+        char source_path[PATH_MAX];
+        snprintf(source_path, sizeof(source_path), "%s/%s", g_project_root, key);
+        return access(source_path, F_OK) != 0;
+    }
+    // A named key "<name>:<path>" is built from that path below md/, e.g.
+    // "tree.json:/sub" lists md/sub
+    const char *colon = strchr(key, ':');
+    if (colon != NULL && colon[1] == '/') {
+        char md_path[PATH_MAX];
+        snprintf(md_path, sizeof(md_path), "%s/md%s", g_project_root, colon + 1);
+        return access(md_path, F_OK) != 0;
+    }
+    return false;
+}
+
+void cache_body_free(CacheBody *body) {
+    if (body->map) {
+        munmap(body->map, body->map_size);
+    } else {
+        free(body->data);
+    }
+    memset(body, 0, sizeof(*body));
+}
+
+// --- Private helpers ---
+
+// Writes to a temporary file and renames it into place, so that concurrent
+// writers and readers never see a partially written entry.
+static bool write_cache_file(const char *path, const CacheFileHeader *hdr, const char *key,
+                             const char *body, size_t size) {
+    make_parent_dirs(path);
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) return false;
+    fchmod(fd, 0644);
+
+    FILE *fp = fdopen(fd, "wb");
+    if (!fp) {
+        close(fd);
+        unlink(tmp_path);
+        return false;
+    }
+    bool written = fwrite(hdr, sizeof(*hdr), 1, fp) == 1 &&
+                   fwrite(key, 1, hdr->key_len, fp) == hdr->key_len &&
+                   fwrite(body, 1, size, fp) == size;
+    if (fclose(fp) != 0 || !written || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return false;
+    }
+    disk_cache_add(path, sizeof(*hdr) + hdr->key_len + size);
+    return true;
+}
+
+// Checks everything in a header that doesn't depend on what the caller looks for.
+static bool header_is_valid(const CacheFileHeader *hdr, size_t file_size) {
+    return memcmp(hdr->magic, CACHE_FILE_MAGIC, sizeof(hdr->magic)) == 0 &&
+           hdr->format_version == CACHE_FILE_VERSION &&
+           hdr->encoding < ENCODING_COUNT &&
+           memchr(hdr->etag, '\0', sizeof(hdr->etag)) != NULL &&
+           memchr(hdr->last_modified, '\0', sizeof(hdr->last_modified)) != NULL &&
+           sizeof(*hdr) + hdr->key_len <= file_size;
+}
+
+// Creates cache/ and the fan-out directories above a cache file as needed.
+static void make_parent_dirs(const char *path) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *p = dir + strlen(g_project_root) + 1; (p = strchr(p, '/')) != NULL; p++) {
+        *p = '\0';
+        mkdir(dir, 0755);  // Fails with EEXIST most of the time, which is fine
+        *p = '/';
+    }
+}
+
+static const char *encoding_extension(ContentEncoding encoding) {
+    switch (encoding) {
+        case ENCODING_GZIP: return ".gz";
+        case ENCODING_ZSTD: return ".zst";
+        case ENCODING_BROTLI: return ".br";
+        default: return "";
+    }
+}
@@ -0,0 +1,114 @@
+#ifndef CACHE_FILE_H
+#define CACHE_FILE_H
+
+#include "cache.h"
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * @brief What a cache file's key refers to.
+ */
+typedef enum {
+    CACHE_KEY_NAMED,    // A caller-chosen name, e.g. the index page
+    CACHE_KEY_SOURCE    // A source file path relative to the project root
+} CacheKeyKind;
+
+/**
+ * @brief An encoded page body, either mapped from its cache file or held on the heap.
+ */
+typedef struct {
+    char *data;
+    size_t size;
+    ino_t file_id;      // Inode of the cache file, 0 if the body is only in memory
+    off_t offset;       // Offset of the body within that file
+    void *map;          // Mapping of the whole file, NULL for heap bodies
+    size_t map_size;
+} CacheBody;
+
+/**
+ * @brief Identifies the source and dependencies content was built from.
+ */
+typedef struct {
+    time_t mtime;       // For content built from several files, the latest mtime
+    off_t size;         // 0 unless built from a single source file
+    ino_t inode;        // 0 unless built from a single source file
+    uint64_t generation;    // For content built from several files, the caller's exact
+                            // version, which also tells apart changes within one second
+    uint64_t deps_hash; // Hash of the template and renderer the content was built with
+} CacheVersion;
+
+/**
+ * @brief What every cache file of an entry records about its content.
+ *
+ * Loaded from the file header on a disk hit, so that serving the entry needs
+ * no stat() of the source and no date formatting.
+ */
+typedef struct {
+    CacheVersion source;
+    uint64_t source_hash;       // hash64() of the source bytes, 0 unless built from a single file
+    uint64_t content_hash;      // hash64() of the uncompressed content
+    size_t content_size;        // Size of the uncompressed content
+    char etag[64];              // Quoted ETag of the content, before any encoding suffix
+    char last_modified[32];     // source.mtime as an HTTP date
+} CacheFileMeta;
+
+/**
+ * @brief Returns the path of the cache file for `key` in `encoding`.
+ *
+ * Keys are hashed (XXH64) and spread over a two-level fan-out of 256 x 256
+ * directories, e.g. cache/3f/a0/3fa01c...e2.gz, so no directory grows large and
+ * distinct keys never share a name. The key itself is kept in the file header.
+ */
+void cache_file_path(const char *key, ContentEncoding encoding, char *out, size_t out_size);
+
+/**
+ * @brief Maps the cache file of `key` in `encoding` if it was built from `version`.
+ *
+ * Validates the header (format version, key, encoding and source) and fills
+ * `meta` from it. Files written by a server with another format version are
+ * misses. Cache files are only ever replaced with rename(), never truncated
+ * in place, so the mapping stays valid until it is released with cache_body_free().
+ *
+ * @param version The source to match, or NULL to accept any.
+ * @return true and fills `body` and `meta` on success.
+ */
+bool cache_file_map(const char *key, ContentEncoding encoding, const CacheVersion *version,
+                    CacheBody *body, CacheFileMeta *meta);
+
+/**
+ * @brief Writes a heap body to its cache file and switches it over to a mapping of that file.
+ *
+ * The body keeps its private copy if the file cannot be written or mapped.
+ */
+void cache_file_store(const char *key, CacheKeyKind kind, ContentEncoding encoding,
+                      const CacheFileMeta *meta, CacheBody *body);
+
+/**
+ * @brief Records a new source version in the headers of all cache files of `key`.
+ *
+ * For sources whose mtime changed but whose bytes did not, so nothing is
+ * rendered or compressed again. Each file is copied with the new header and
+ * renamed over the old one, like cache_file_store() does, so readers never see
+ * a half-updated header; existing mappings keep the old file.
+ *
+ * @param last_modified The new source mtime as an HTTP date.
+ */
+void cache_file_restamp(const char *key, const CacheVersion *version, const char *last_modified);
+
+/**
+ * @brief Returns true if a cache file can be deleted: it has an unknown format,
+ * or it belongs to a source file that no longer exists.
+ *
+ * Named keys of the form "<name>:<path>", e.g. "tree.html:/sub", are taken to
+ * be built from <path> below md/, and are orphans once it no longer exists.
+ */
+bool cache_file_is_orphan(const char *path);
+
+/**
+ * @brief Releases a body's mapping or heap copy.
+ */
+void cache_body_free(CacheBody *body);
+
+#endif // CACHE_FILE_H
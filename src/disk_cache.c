@@ -0,0 +1,233 @@
+#include "disk_cache.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// Number of hash buckets for tracked files. Must be a power of two.
+#define DISK_CACHE_BUCKETS 4096
+// Depth of the subdirectories cache files are spread over (see cache_file_path())
+#define DISK_CACHE_FANOUT_LEVELS 2
+
+typedef struct DiskEntry {
+    char *path;
+    size_t size;
+    time_t mtime;               // Only used to order the files found at startup
+    struct DiskEntry *hash_next;
+    struct DiskEntry *lru_prev, *lru_next;
+} DiskEntry;
+
+// Files found by the startup scan
+typedef struct {
+    DiskEntry **entries;
+    size_t count, capacity;
+    bool (*is_orphan)(const char *path);
+} ScanResult;
+
+// `lock` guards everything; files are unlinked outside of it.
+static struct {
+    pthread_mutex_t lock;
+    DiskEntry *buckets[DISK_CACHE_BUCKETS];
+    DiskEntry *lru_head, *lru_tail;     // Most recently used at the head
+    size_t total_bytes;
+    size_t max_bytes;                   // 0 = unlimited
+    bool open;
+} s_disk = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Forward declarations
+static DiskEntry *find_entry(const char *path);
+static DiskEntry *add_entry(const char *path, size_t size);
+static char *remove_entry(DiskEntry *entry);
+static void lru_unlink(DiskEntry *entry);
+static void lru_push_front(DiskEntry *entry);
+static void evict_over_budget(const DiskEntry *keep);
+static bool scan_dir(const char *dir, int depth, ScanResult *found);
+static bool is_cache_file(const char *name);
+static int compare_mtime(const void *a, const void *b);
+
+bool disk_cache_open(const char *dir, size_t max_bytes, bool (*is_orphan)(const char *path)) {
+    ScanResult found = { .is_orphan = is_orphan };
+    if (!scan_dir(dir, 0, &found)) return false;
+
+    // Without access times from previous runs, the last write decides the order
+    qsort(found.entries, found.count, sizeof(*found.entries), compare_mtime);
+
+    pthread_mutex_lock(&s_disk.lock);
+    s_disk.max_bytes = max_bytes;
+    for (size_t i = 0; i < found.count; i++) {
+        DiskEntry *entry = found.entries[i];
+        unsigned long bucket = hash_string(entry->path) & (DISK_CACHE_BUCKETS - 1);
+        entry->hash_next = s_disk.buckets[bucket];
+        s_disk.buckets[bucket] = entry;
+        lru_push_front(entry);
+        s_disk.total_bytes += entry->size;
+    }
+    s_disk.open = true;
+    pthread_mutex_unlock(&s_disk.lock);
+    free(found.entries);
+
+    evict_over_budget(NULL);
+    return true;
+}
+
+void disk_cache_add(const char *path, size_t size) {
+    pthread_mutex_lock(&s_disk.lock);
+    if (!s_disk.open) {
+        pthread_mutex_unlock(&s_disk.lock);
+        return;
+    }
+    DiskEntry *entry = find_entry(path);
+    if (entry) {
+        s_disk.total_bytes = s_disk.total_bytes - entry->size + size;
+        entry->size = size;
+        lru_unlink(entry);
+        lru_push_front(entry);
+    } else {
+        entry = add_entry(path, size);
+    }
+    pthread_mutex_unlock(&s_disk.lock);
+
+    // The entry is only used for comparison; it may be gone by the time we evict
+    evict_over_budget(entry);
+}
+
+void disk_cache_touch(const char *path) {
+    pthread_mutex_lock(&s_disk.lock);
+    DiskEntry *entry = find_entry(path);
+    if (entry) {
+        lru_unlink(entry);
+        lru_push_front(entry);
+    }
+    pthread_mutex_unlock(&s_disk.lock);
+}
+
+// --- Private helpers ---
+
+// Deletes the least recently used files until the total fits the budget.
+static void evict_over_budget(const DiskEntry *keep) {
+    for (;;) {
+        pthread_mutex_lock(&s_disk.lock);
+        DiskEntry *victim = s_disk.lru_tail;
+        if (s_disk.max_bytes == 0 || s_disk.total_bytes <= s_disk.max_bytes || !victim || victim == keep) {
+            pthread_mutex_unlock(&s_disk.lock);
+            return;
+        }
+        char *path = remove_entry(victim);
+        pthread_mutex_unlock(&s_disk.lock);
+
+        // A memory cache entry may still map the file; unlinking doesn't disturb that
+        unlink(path);
+        free(path);
+    }
+}
+
+static DiskEntry *find_entry(const char *path) {
+    DiskEntry *entry = s_disk.buckets[hash_string(path) & (DISK_CACHE_BUCKETS - 1)];
+    while (entry && strcmp(entry->path, path) != 0) entry = entry->hash_next;
+    return entry;
+}
+
+static DiskEntry *add_entry(const char *path, size_t size) {
+    DiskEntry *entry = calloc(1, sizeof(*entry));
+    if (!entry || !(entry->path = strdup(path))) {
+        free(entry);
+        return NULL;
+    }
+    entry->size = size;
+    unsigned long bucket = hash_string(path) & (DISK_CACHE_BUCKETS - 1);
+    entry->hash_next = s_disk.buckets[bucket];
+    s_disk.buckets[bucket] = entry;
+    lru_push_front(entry);
+    s_disk.total_bytes += size;
+    return entry;
+}
+
+// Unlinks an entry from the table and frees it, except for its path, which is returned.
+static char *remove_entry(DiskEntry *entry) {
+    DiskEntry **pp = &s_disk.buckets[hash_string(entry->path) & (DISK_CACHE_BUCKETS - 1)];
+    while (*pp && *pp != entry) pp = &(*pp)->hash_next;
+    if (*pp) *pp = entry->hash_next;
+    lru_unlink(entry);
+    s_disk.total_bytes -= entry->size;
+    char *path = entry->path;
+    free(entry);
+    return path;
+}
+
+static void lru_unlink(DiskEntry *entry) {
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else s_disk.lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else s_disk.lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(DiskEntry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = s_disk.lru_head;
+    if (s_disk.lru_head) s_disk.lru_head->lru_prev = entry;
+    s_disk.lru_head = entry;
+    if (!s_disk.lru_tail) s_disk.lru_tail = entry;
+}
+
+// Collects the cache files below `dir`, descending into the fan-out
+// directories, and deletes temporary files and orphans along the way.
+static bool scan_dir(const char *dir, int depth, ScanResult *found) {
+    DIR *d = opendir(dir);
+    if (!d) return false;
+
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        struct stat st;
+        if (lstat(path, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            if (depth < DISK_CACHE_FANOUT_LEVELS) scan_dir(path, depth + 1, found);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) continue;
+        if (!is_cache_file(de->d_name) || (found->is_orphan && found->is_orphan(path))) {
+            unlink(path);  // Unfinished write, or an entry nothing can look up anymore
+            continue;
+        }
+        if (found->count == found->capacity) {
+            size_t capacity = found->capacity ? found->capacity * 2 : 256;
+            DiskEntry **bigger = realloc(found->entries, capacity * sizeof(*bigger));
+            if (!bigger) break;
+            found->entries = bigger;
+            found->capacity = capacity;
+        }
+        DiskEntry *entry = calloc(1, sizeof(*entry));
+        if (!entry || !(entry->path = strdup(path))) {
+            free(entry);
+            break;
+        }
+        entry->size = (size_t)st.st_size;
+        entry->mtime = st.st_mtime;
+        found->entries[found->count++] = entry;
+    }
+    closedir(d);
+    return true;
+}
+
+// Temporary files from write_cache_file() carry a random suffix after the extension
+static bool is_cache_file(const char *name) {
+    static const char *const extensions[] = { ".gz", ".zst", ".br" };
+    size_t len = strlen(name);
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        size_t ext_len = strlen(extensions[i]);
+        if (len > ext_len && strcmp(name + len - ext_len, extensions[i]) == 0) return true;
+    }
+    return false;
+}
+
+static int compare_mtime(const void *a, const void *b) {
+    time_t ta = (*(DiskEntry *const *)a)->mtime, tb = (*(DiskEntry *const *)b)->mtime;
+    return (ta > tb) - (ta < tb);
+}
@@ -0,0 +1,34 @@
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * @brief Starts tracking the files in the disk cache directory.
+ *
+ * Scans `dir` and its fan-out subdirectories once, removing leftover temporary
+ * files and every file `is_orphan` rejects, and keeps the size and last use of
+ * every cache file in memory from then on. Whenever the total size exceeds
+ * `max_bytes`, the least recently used files are deleted.
+ *
+ * @param dir Absolute path of the cache directory.
+ * @param max_bytes The disk budget, 0 for no limit.
+ * @param is_orphan Returns true for files that should be deleted, may be NULL.
+ * @return false if the directory cannot be read.
+ */
+bool disk_cache_open(const char *dir, size_t max_bytes, bool (*is_orphan)(const char *path));
+
+/**
+ * @brief Records a file that was written to the cache directory, replacing any earlier size.
+ *
+ * Evicts older files if the budget is exceeded, but never the one just added.
+ */
+void disk_cache_add(const char *path, size_t size);
+
+/**
+ * @brief Marks a cache file as used, moving it to the back of the eviction order.
+ */
+void disk_cache_touch(const char *path);
+
+#endif // DISK_CACHE_H
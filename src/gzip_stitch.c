@@ -0,0 +1,76 @@
+#include "gzip_stitch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <zlib.h>
+
+// Member header of RFC 1952 as zlib writes it: deflate, no flags, no mtime, Unix
+static const char GZIP_HEADER[10] = { 0x1f, (char) 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+// A final, empty block with fixed Huffman codes, which ends the deflate data
+static const char FINAL_BLOCK[2] = { 0x03, 0x00 };
+
+bool gzip_piece_compress(const char *data, size_t len, GzipPiece *piece) {
+    memset(piece, 0, sizeof(*piece));
+    if (len == 0) return true;
+
+    z_stream strm = {0};
+    if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    // deflateBound() assumes Z_FINISH; a full flush adds an empty stored block (5 bytes)
+    size_t bound = deflateBound(&strm, len) + 16;
+    unsigned char *out = malloc(bound);
+    if (out == NULL) {
+        deflateEnd(&strm);
+        return false;
+    }
+    strm.next_in = (Bytef *) data;
+    strm.avail_in = len;
+    strm.next_out = out;
+    strm.avail_out = bound;
+    int ret = deflate(&strm, Z_FULL_FLUSH);
+    bool done = ret == Z_OK && strm.avail_in == 0 && strm.avail_out > 0;
+    size_t size = strm.total_out;
+    deflateEnd(&strm);
+    if (!done) {
+        free(out);
+        return false;
+    }
+
+    piece->data = (char *) out;
+    piece->size = size;
+    piece->crc = crc32(0L, (const Bytef *) data, len);
+    piece->len = len;
+    return true;
+}
+
+void gzip_piece_free(GzipPiece *piece) {
+    free(piece->data);
+    memset(piece, 0, sizeof(*piece));
+}
+
+void gzip_stitch_begin(GzipStitch *gz, size_t capacity) {
+    str_buf_init(&gz->out, capacity + sizeof(GZIP_HEADER) + sizeof(FINAL_BLOCK) + 8);
+    str_buf_append_n(&gz->out, GZIP_HEADER, sizeof(GZIP_HEADER));
+    gz->crc = crc32(0L, Z_NULL, 0);
+    gz->len = 0;
+}
+
+void gzip_stitch_append(GzipStitch *gz, const GzipPiece *piece) {
+    if (piece->len == 0) return;
+    str_buf_append_n(&gz->out, piece->data, piece->size);
+    gz->crc = crc32_combine(gz->crc, piece->crc, (z_off_t) piece->len);
+    gz->len += piece->len;
+}
+
+char *gzip_stitch_finish(GzipStitch *gz, size_t *size) {
+    // Trailer: CRC-32 and the uncompressed size modulo 2^32, both little-endian
+    unsigned char trailer[8];
+    for (int i = 0; i < 4; i++) {
+        trailer[i] = (unsigned char) (gz->crc >> (8 * i));
+        trailer[4 + i] = (unsigned char) ((uint64_t) gz->len >> (8 * i));
+    }
+    str_buf_append_n(&gz->out, FINAL_BLOCK, sizeof(FINAL_BLOCK));
+    str_buf_append_n(&gz->out, (const char *) trailer, sizeof(trailer));
+    return str_buf_detach(&gz->out, size);
+}
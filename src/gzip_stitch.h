@@ -0,0 +1,61 @@
+#ifndef GZIP_STITCH_H
+#define GZIP_STITCH_H
+
+#include "str_buf.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * @brief A piece of a page, deflated on its own so it can be reused in any gzip stream.
+ *
+ * The raw deflate data ends on a full flush, i.e. on a byte boundary with no
+ * references to earlier data, and without a final block, so pieces can be
+ * concatenated in any order.
+ */
+typedef struct {
+    char *data;         // Raw deflate data, NULL for an empty piece
+    size_t size;
+    unsigned long crc;  // crc32() of the uncompressed bytes
+    size_t len;         // Number of uncompressed bytes
+} GzipPiece;
+
+/**
+ * @brief A gzip stream being assembled from pieces.
+ */
+typedef struct {
+    StrBuf out;
+    unsigned long crc;
+    size_t len;
+} GzipStitch;
+
+/**
+ * @brief Deflates `len` bytes of `data` into a piece.
+ *
+ * @return false if compression failed; `piece` is then empty.
+ */
+bool gzip_piece_compress(const char *data, size_t len, GzipPiece *piece);
+
+/**
+ * @brief Releases the data of a piece.
+ */
+void gzip_piece_free(GzipPiece *piece);
+
+/**
+ * @brief Starts a gzip stream with room for about `capacity` bytes.
+ */
+void gzip_stitch_begin(GzipStitch *gz, size_t capacity);
+
+/**
+ * @brief Appends a piece. Its checksum is folded in with crc32_combine(), so
+ * the piece's bytes are neither compressed nor read again.
+ */
+void gzip_stitch_append(GzipStitch *gz, const GzipPiece *piece);
+
+/**
+ * @brief Ends the stream with a final empty block and the gzip trailer.
+ *
+ * @return The gzip data, to be released with free(), or NULL on allocation failure.
+ */
+char *gzip_stitch_finish(GzipStitch *gz, size_t *size);
+
+#endif // GZIP_STITCH_H
@@ -1,11 +1,76 @@
 #include "http_helpers.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#if MG_ENABLE_EPOLL
+#include <sys/sendfile.h>
+#endif
+
+// Persistent connections are closed after this long without traffic
+#define KEEP_ALIVE_TIMEOUT_MS 5000
+// ... or after serving this many requests
+#define MAX_REQUESTS_PER_CONNECTION 1000
+// A request parked for the render pool is looked up once more after this long,
+// and answered 503 if its page still isn't cached. Bounds the wait when a
+// wakeup was lost or a job never finishes.
+#define RENDER_WAIT_TIMEOUT_MS 5000
+// Bodies at least this large are sent from their cache file with sendfile();
+// below that, copying is cheaper than the extra open() and fstat()
+#define SENDFILE_MIN_SIZE (64 * 1024)
+// Bump when the markup of error pages changes, so cached copies are rebuilt
+#define ERROR_PAGE_VERSION 1
+
+// A response body being sent from a file
+typedef struct {
+    int fd;
+    off_t offset;
+    size_t remaining;
+} FileStream;
+
+// Per-connection state, stored in mg_connection::data
+typedef struct {
+    uint32_t last_activity;     // now_ms() of the last read or write
+    uint32_t deferred_at;       // now_ms() when `deferred` was parked
+    union {                     // A request is never deferred while its body is sent
+        char *deferred;         // Copy of a request waiting for the render pool
+        FileStream *stream;     // Body left to send after the headers
+    };
+    uint16_t requests;          // Requests received on this connection
+    int16_t render_status;      // Status of the finished render while its request is replayed
+    bool keep_alive;            // Whether the current response leaves the connection open
+    bool is_http10;
+    bool streaming;             // `stream` rather than `deferred` is in use
+    bool wait_expired;          // The request is replayed after RENDER_WAIT_TIMEOUT_MS
+} ConnState;
+
+// mg_http_serve_dir() keeps the remaining length of a static file in the last
+// size_t of mg_connection::data, so the state must end before it
+_Static_assert(sizeof(ConnState) <= MG_DATA_SIZE - sizeof(size_t),
+               "ConnState overlaps the bytes mongoose uses in mg_connection::data");
+_Static_assert(MAX_REQUESTS_PER_CONNECTION <= UINT16_MAX, "ConnState::requests is too small");
+
+// Forward declarations
+static const char *status_text(int status);
+static char *generate_error_page(const char *key, size_t *size);
+
+static ConnState *conn_state(struct mg_connection *c) {
+    return (ConnState *) c->data;
+}
+
+// The low 32 bits of mg_millis(). Differences of these wrap correctly, and
+// every interval measured with them is far below the 49 days they span.
+static uint32_t now_ms(void) {
+    return (uint32_t) mg_millis();
+}
 
 bool handle_conditional_request(
     struct mg_connection *c,
     struct mg_http_message *hm,
     const char *etag,
-    time_t last_modified // Parameter kept for future use, but currently unused.
+    time_t last_modified
 ) {
     // Check ETag / If-None-Match
     const struct mg_str *etag_hdr = mg_http_get_header(hm, "If-None-Match");
@@ -13,13 +78,433 @@ bool handle_conditional_request(
         // A simple string comparison is sufficient for our ETag format.
         // A more robust implementation would parse comma-separated values.
         if (mg_strcmp(*etag_hdr, mg_str(etag)) == 0) {
-            mg_http_reply(c, 304, "", "");
+            // A 304 repeats the validators and Vary of the 200 it stands for
+            // (RFC 9110, 15.4.5), so shared caches keep the encodings apart
+            char last_modified_str[32];
+            format_http_date(last_modified, last_modified_str, sizeof(last_modified_str));
+            mg_printf(c,
+                      "HTTP/1.1 304 Not Modified\r\n"
+                      "ETag: %s\r\n"
+                      "Last-Modified: %s\r\n"
+                      "Vary: Accept-Encoding\r\n"
+                      "%s"
+                      "\r\n",
+                      etag, last_modified_str, http_connection_header(c));
+            http_end_response(c);
             return true; // Request handled
         }
     }
 
     // If-Modified-Since logic is omitted due to lack of a standard date parsing function.
-    (void)last_modified; // Suppress unused parameter warning
 
     return false; // Request not handled, caller should send full response
 }
+
+void format_http_date(time_t t, char *out, size_t size) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(out, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+void http_begin_request(struct mg_connection *c, struct mg_http_message *hm) {
+    ConnState *st = conn_state(c);
+    st->requests++;
+    st->is_http10 = mg_strcasecmp(hm->proto, mg_str("HTTP/1.0")) == 0;
+
+    const struct mg_str *conn_hdr = mg_http_get_header(hm, "Connection");
+    if (conn_hdr != NULL && mg_strcasecmp(*conn_hdr, mg_str("close")) == 0) {
+        st->keep_alive = false;
+    } else if (st->is_http10) {
+        st->keep_alive = conn_hdr != NULL && mg_strcasecmp(*conn_hdr, mg_str("keep-alive")) == 0;
+    } else {
+        st->keep_alive = true;
+    }
+    if (st->requests >= MAX_REQUESTS_PER_CONNECTION) {
+        st->keep_alive = false;
+    }
+}
+
+const char *http_connection_header(struct mg_connection *c) {
+    ConnState *st = conn_state(c);
+    if (!st->keep_alive) return "Connection: close\r\n";
+    return st->is_http10 ? "Connection: keep-alive\r\n" : "";
+}
+
+void http_reply(struct mg_connection *c, int status, const char *headers, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    char *body = mg_vmprintf(fmt, &ap);
+    va_end(ap);
+    char all_headers[256];
+    snprintf(all_headers, sizeof(all_headers), "%s%s", headers, http_connection_header(c));
+    mg_http_reply(c, status, all_headers, "%s", body ? body : "");
+    free(body);
+}
+
+void http_end_response(struct mg_connection *c) {
+    if (!conn_state(c)->keep_alive) {
+        c->is_draining = 1;
+    }
+    c->is_resp = 0;
+}
+
+// Queues the header block of a response with a body of `body_len` bytes.
+// `etag` and `last_modified_str` may be NULL to omit those headers.
+static void send_encoded_headers(
+    struct mg_connection *c,
+    int status,
+    const char *content_type,
+    ContentEncoding encoding,
+    const char *etag,
+    const char *last_modified_str,
+    size_t body_len
+) {
+    char encoding_header[64] = "";
+    if (encoding != ENCODING_IDENTITY) {
+        snprintf(encoding_header, sizeof(encoding_header), "Content-Encoding: %s\r\n",
+                 http_encoding_token(encoding));
+    }
+
+    char validators[160] = "";
+    if (etag != NULL && last_modified_str != NULL) {
+        snprintf(validators, sizeof(validators), "ETag: %s\r\nLast-Modified: %s\r\n",
+                 etag, last_modified_str);
+    }
+
+    char headers[512];
+    int n = snprintf(headers, sizeof(headers),
+                     "HTTP/1.1 %d %s\r\n"
+                     "Content-Type: %s\r\n"
+                     "%s"
+                     "Vary: Accept-Encoding\r\n"
+                     "%s"
+                     "Content-Length: %zu\r\n"
+                     "%s"
+                     "\r\n",
+                     status, status_text(status), content_type, encoding_header, validators,
+                     body_len, http_connection_header(c));
+
+    mg_send(c, headers, (size_t) n);
+}
+
+void http_send_encoded_response(
+    struct mg_connection *c,
+    const char *content_type,
+    ContentEncoding encoding,
+    const char *etag,
+    const char *last_modified_str,
+    const char *body,
+    size_t body_len
+) {
+    send_encoded_headers(c, 200, content_type, encoding, etag, last_modified_str, body_len);
+    mg_send(c, body, body_len);
+    http_end_response(c);
+}
+
+void http_send_cache_result(struct mg_connection *c, const char *content_type, const CacheResult *result) {
+#if MG_ENABLE_EPOLL
+    ConnState *st = conn_state(c);
+    if (result->size >= SENDFILE_MIN_SIZE && !c->is_tls && st->deferred == NULL) {
+        off_t offset = 0;
+        int fd = cache_result_open(result, &offset);
+        FileStream *stream = fd >= 0 ? malloc(sizeof(*stream)) : NULL;
+        if (stream) {
+            stream->fd = fd;
+            stream->offset = offset;
+            stream->remaining = result->size;
+            st->stream = stream;
+            st->streaming = true;
+            send_encoded_headers(c, 200, content_type, result->encoding, result->etag,
+                                 result->last_modified_str, result->size);
+            // c->is_resp stays set until stream_body() has sent the whole file
+            return;
+        }
+        if (fd >= 0) close(fd);
+    }
+#endif
+    http_send_encoded_response(c, content_type, result->encoding, result->etag,
+                               result->last_modified_str, result->content, result->size);
+}
+
+void http_send_error(struct mg_connection *c, struct mg_http_message *hm, int status) {
+    // Error pages go through the cache like any page, so they are compressed
+    // once rather than on every 404 a scanner provokes
+    if (status != 400 && status != 404 && status != 503) status = 500;
+    char key[32];
+    snprintf(key, sizeof(key), "error/%d", status);
+    CacheDeps deps = { .renderer = ERROR_PAGE_VERSION };
+    CacheResult result = get_cached_version(key, 0, 0, &deps);
+    if (result.entry == NULL) {
+        // A few hundred bytes: cheap enough to build on the event loop, once
+        result = get_cached_or_generate_version(key, key, 0, 0, &deps, generate_error_page);
+    }
+    ContentEncoding encoding = result.entry ? http_negotiate_encoding(hm, cache_result_encodings(&result))
+                                            : ENCODING_IDENTITY;
+    if (result.entry == NULL || !cache_result_select(&result, encoding)) {
+        release_cache_result(result);
+        http_reply(c, status, "Content-Type: text/plain; charset=utf-8\r\n", "%s\n", status_text(status));
+        return;
+    }
+
+    send_encoded_headers(c, status, "text/html; charset=utf-8", result.encoding, NULL, NULL, result.size);
+    mg_send(c, result.content, result.size);
+    http_end_response(c);
+    release_cache_result(result);
+}
+
+static void end_stream(struct mg_connection *c) {
+    ConnState *st = conn_state(c);
+    close(st->stream->fd);
+    free(st->stream);
+    st->stream = NULL;
+    st->streaming = false;
+}
+
+#if MG_ENABLE_EPOLL
+// Sends as much of the file body as the socket takes. Mongoose only polls for
+// writability while its own send buffer is non-empty, so EPOLLOUT is kept armed
+// here until the body is complete; each wakeup then arrives as MG_EV_POLL.
+static void stream_body(struct mg_connection *c) {
+    ConnState *st = conn_state(c);
+    FileStream *stream = st->stream;
+    while (stream->remaining > 0) {
+        ssize_t n = sendfile((int) (size_t) c->fd, stream->fd, &stream->offset, stream->remaining);
+        if (n > 0) {
+            stream->remaining -= (size_t) n;
+            st->last_activity = now_ms();
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            MG_EPOLL_MOD(c, 1);
+            return;
+        } else {
+            // The peer is gone or the file was truncated: the response can't be completed
+            end_stream(c);
+            c->is_closing = 1;
+            return;
+        }
+    }
+    end_stream(c);
+    MG_EPOLL_MOD(c, 0);
+    http_end_response(c);
+}
+#endif
+
+const char *http_encoding_token(ContentEncoding encoding) {
+    switch (encoding) {
+        case ENCODING_GZIP: return "gzip";
+        case ENCODING_ZSTD: return "zstd";
+        case ENCODING_BROTLI: return "br";
+        default: return "identity";
+    }
+}
+
+// Parses a qvalue ("1", "0.5", "0.125") into thousandths.
+static int parse_qvalue(struct mg_str v) {
+    int q = 0, scale = 1000;
+    size_t i = 0;
+    if (i < v.len && v.buf[i] >= '0' && v.buf[i] <= '9') q = (v.buf[i++] - '0') * 1000;
+    if (i < v.len && v.buf[i] == '.') {
+        for (i++; i < v.len && v.buf[i] >= '0' && v.buf[i] <= '9' && scale > 1; i++) {
+            scale /= 10;
+            q += (v.buf[i] - '0') * scale;
+        }
+    }
+    return q > 1000 ? 1000 : q;
+}
+
+static struct mg_str trim(struct mg_str s) {
+    while (s.len > 0 && (s.buf[0] == ' ' || s.buf[0] == '\t')) s.buf++, s.len--;
+    while (s.len > 0 && (s.buf[s.len - 1] == ' ' || s.buf[s.len - 1] == '\t')) s.len--;
+    return s;
+}
+
+ContentEncoding http_negotiate_encoding(struct mg_http_message *hm, unsigned available) {
+    const struct mg_str *hdr = mg_http_get_header(hm, "Accept-Encoding");
+    if (hdr == NULL) return ENCODING_IDENTITY;
+
+    // qvalue in thousandths per encoding, -1 where the client didn't mention it
+    int q[ENCODING_COUNT];
+    int star_q = -1;
+    for (int enc = 0; enc < ENCODING_COUNT; enc++) q[enc] = -1;
+
+    struct mg_str rest = *hdr, item;
+    while (mg_span(rest, &item, &rest, ',')) {
+        struct mg_str token, params, param;
+        mg_span(item, &token, &params, ';');
+        token = trim(token);
+        int value = 1000;
+        while (mg_span(params, &param, &params, ';')) {
+            param = trim(param);
+            if (param.len > 2 && (param.buf[0] == 'q' || param.buf[0] == 'Q') && param.buf[1] == '=') {
+                value = parse_qvalue(mg_str_n(param.buf + 2, param.len - 2));
+            }
+        }
+        if (mg_strcasecmp(token, mg_str("*")) == 0) {
+            star_q = value;
+        } else if (mg_strcasecmp(token, mg_str("gzip")) == 0 || mg_strcasecmp(token, mg_str("x-gzip")) == 0) {
+            q[ENCODING_GZIP] = value;
+        } else if (mg_strcasecmp(token, mg_str("zstd")) == 0) {
+            q[ENCODING_ZSTD] = value;
+        } else if (mg_strcasecmp(token, mg_str("br")) == 0) {
+            q[ENCODING_BROTLI] = value;
+        } else if (mg_strcasecmp(token, mg_str("identity")) == 0) {
+            q[ENCODING_IDENTITY] = value;
+        }
+    }
+
+    // Pick the acceptable encoding with the highest qvalue; on a tie, the later
+    // (better compressing) one in the enum wins
+    ContentEncoding best = ENCODING_IDENTITY;
+    int best_q = 0;
+    for (int enc = 0; enc < ENCODING_COUNT; enc++) {
+        if (!(available & (1u << enc))) continue;
+        int value = q[enc] >= 0 ? q[enc] : star_q;
+        // identity is acceptable unless excluded explicitly or through "*;q=0"
+        if (value < 0) value = enc == ENCODING_IDENTITY ? 1 : 0;
+        if (value > 0 && value >= best_q) {
+            best = (ContentEncoding) enc;
+            best_q = value;
+        }
+    }
+    return best;
+}
+
+void http_defer_to_render_pool(
+    struct mg_connection *c,
+    struct mg_http_message *hm,
+    const char *key,
+    render_job_fn job
+) {
+    ConnState *st = conn_state(c);
+    if (st->wait_expired) {
+        // The page still isn't there after waiting RENDER_WAIT_TIMEOUT_MS; let
+        // the client retry rather than park it again
+        http_reply(c, 503, "Content-Type: text/plain; charset=utf-8\r\nRetry-After: 1\r\n",
+                   "Service Unavailable\n");
+        return;
+    }
+    // hm may point into the previous copy when a replayed request is deferred again
+    char *copy = malloc(hm->message.len + 1);
+    if (copy) {
+        memcpy(copy, hm->message.buf, hm->message.len);
+        copy[hm->message.len] = '\0';
+    }
+    if (!copy || !render_pool_submit(c->mgr, c->id, key, job)) {
+        free(copy);
+        http_reply(c, 503, "Content-Type: text/plain; charset=utf-8\r\nRetry-After: 1\r\n",
+                   "Service Unavailable\n");
+        return;
+    }
+    free(st->deferred);
+    st->deferred = copy;
+    st->deferred_at = now_ms();
+    // c->is_resp stays set, so mongoose holds back pipelined requests until we reply
+}
+
+char *http_resume_request(struct mg_connection *c, const struct mg_str *wakeup_data,
+                          struct mg_http_message *hm) {
+    ConnState *st = conn_state(c);
+    char *request = st->deferred;
+    if (!request || wakeup_data->len < sizeof(int)) return NULL;
+
+    st->deferred = NULL;
+    if (mg_http_parse(request, strlen(request), hm) <= 0) {
+        free(request);
+        http_reply(c, 500, "", "Internal Server Error\n");
+        return NULL;
+    }
+    int status;
+    memcpy(&status, wakeup_data->buf, sizeof(status));
+    st->render_status = (int16_t) status;
+    return request;
+}
+
+char *http_resume_expired_request(struct mg_connection *c, struct mg_http_message *hm) {
+    ConnState *st = conn_state(c);
+    if (!c->is_accepted || st->streaming || st->deferred == NULL ||
+        now_ms() - st->deferred_at <= RENDER_WAIT_TIMEOUT_MS) {
+        return NULL;
+    }
+
+    // Replayed like a fresh request: served if the page is cached by now.
+    // The job may still wake the connection later; with nothing parked, that
+    // wakeup is ignored.
+    char *request = st->deferred;
+    st->deferred = NULL;
+    if (mg_http_parse(request, strlen(request), hm) <= 0) {
+        free(request);
+        http_reply(c, 500, "", "Internal Server Error\n");
+        return NULL;
+    }
+    st->wait_expired = true;
+    return request;
+}
+
+void http_end_replay(struct mg_connection *c, char *request) {
+    ConnState *st = conn_state(c);
+    st->render_status = 0;
+    st->wait_expired = false;
+    free(request);
+}
+
+int http_render_status(struct mg_connection *c) {
+    return conn_state(c)->render_status;
+}
+
+void http_handle_connection_event(struct mg_connection *c, int ev) {
+    if (!c->is_accepted) return;
+
+    ConnState *st = conn_state(c);
+    if (ev == MG_EV_CLOSE) {
+        if (st->streaming) {
+            end_stream(c);
+        } else {
+            free(st->deferred);
+            st->deferred = NULL;
+        }
+    } else if (ev == MG_EV_ACCEPT || ev == MG_EV_READ || ev == MG_EV_WRITE) {
+        st->last_activity = now_ms();
+#if MG_ENABLE_EPOLL
+        // Headers flushed: ask for a wakeup to start sending the file
+        if (ev == MG_EV_WRITE && st->streaming && c->send.len == 0) MG_EPOLL_MOD(c, 1);
+    } else if (ev == MG_EV_POLL && st->streaming) {
+        if (c->send.len == 0) stream_body(c);
+#endif
+    } else if (ev == MG_EV_HTTP_MSG || ev == MG_EV_WAKEUP) {
+        // Responses sent with http_reply() or mg_http_serve_dir() finish the
+        // response themselves; close the connection after them if it isn't kept alive.
+        if (!c->is_resp && !st->keep_alive) c->is_draining = 1;
+    } else if (ev == MG_EV_POLL) {
+        // Close idle keep-alive connections, but never one with a response in progress
+        if (!c->is_resp && c->send.len == 0 &&
+            now_ms() - st->last_activity > KEEP_ALIVE_TIMEOUT_MS) {
+            c->is_closing = 1;
+        }
+    }
+}
+
+static const char *status_text(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 503: return "Service Unavailable";
+        default: return "Internal Server Error";
+    }
+}
+
+// Cache generator for error pages; the status is taken from the key ("error/404").
+static char *generate_error_page(const char *key, size_t *size) {
+    const char *slash = strrchr(key, '/');
+    int status = slash ? atoi(slash + 1) : 500;
+    const char *text = status_text(status);
+    char *page = malloc(256);
+    if (page == NULL) return NULL;
+    int n = snprintf(page, 256,
+                     "<!DOCTYPE html>\n<html>\n<head><meta charset=\"utf-8\"><title>%d %s</title></head>\n"
+                     "<body><h1>%d %s</h1><p><a href=\"/\">Back to the index</a></p></body>\n</html>\n",
+                     status, text, status, text);
+    *size = (size_t) n;
+    return page;
+}
@@ -2,6 +2,8 @@
 #define HTTP_HELPERS_H
 
 #include "mongoose.h"
+#include "render_pool.h"
+#include "cache.h"
 #include <time.h>
 #include <stdbool.h>
 
@@ -10,7 +12,8 @@
  *
  * This function checks the request headers for "If-None-Match" and "If-Modified-Since".
  * If a match is found with the provided etag or last_modified time, it sends a
- * "304 Not Modified" response and returns true.
+ * "304 Not Modified" response and returns true. Like the full response, the 304
+ * carries ETag, Last-Modified and "Vary: Accept-Encoding".
  *
  * @param c The mongoose connection.
  * @param hm The HTTP request message.
@@ -25,4 +28,173 @@ bool handle_conditional_request(
     time_t last_modified
 );
 
+/**
+ * @brief Records the start of a request on a persistent connection.
+ *
+ * Counts requests per connection and decides whether the connection is kept
+ * open after the response: HTTP/1.0 clients must ask for keep-alive, a
+ * "Connection: close" request is honored, and a connection is closed after
+ * MAX_REQUESTS_PER_CONNECTION requests.
+ *
+ * @param c The mongoose connection.
+ * @param hm The HTTP request message.
+ */
+void http_begin_request(struct mg_connection *c, struct mg_http_message *hm);
+
+/**
+ * @brief Returns the "Connection" header line to add to a manually built response.
+ *
+ * @return "Connection: close\r\n", "Connection: keep-alive\r\n" or "" (HTTP/1.1 default).
+ */
+const char *http_connection_header(struct mg_connection *c);
+
+/**
+ * @brief Like mg_http_reply(), but with the Connection header from http_connection_header().
+ *
+ * Use it instead of mg_http_reply(), so that HTTP/1.0 clients that asked for
+ * keep-alive are told the connection stays open.
+ *
+ * @param headers Extra header lines, each ending in "\r\n"; "" for none.
+ */
+void http_reply(struct mg_connection *c, int status, const char *headers, const char *fmt, ...);
+
+/**
+ * @brief Marks the end of a response sent with mg_send().
+ *
+ * Lets mongoose parse the next pipelined request on the connection, or closes
+ * it once the response is flushed if it should not be kept alive.
+ */
+void http_end_response(struct mg_connection *c);
+
+/**
+ * @brief Sends a complete 200 response with a body in the given content encoding.
+ *
+ * Framed with Content-Length so the connection can be reused. Always carries
+ * "Vary: Accept-Encoding", since the same URL is served in several encodings.
+ */
+void http_send_encoded_response(
+    struct mg_connection *c,
+    const char *content_type,
+    ContentEncoding encoding,
+    const char *etag,
+    const char *last_modified_str,
+    const char *body,
+    size_t body_len
+);
+
+/**
+ * @brief Sends a cached page in the encoding selected on `result`.
+ *
+ * Large bodies are sent straight from their disk cache file with sendfile(),
+ * so they are never copied through user space; the response then completes
+ * asynchronously and the connection holds its own file descriptor, not a
+ * reference to `result`. Everything else goes through http_send_encoded_response().
+ */
+void http_send_cache_result(struct mg_connection *c, const char *content_type, const CacheResult *result);
+
+/**
+ * @brief Sends a small HTML error page, compressed if the client accepts it.
+ *
+ * Error pages are built and compressed once and then served from the cache.
+ * Falls back to a plain-text reply if the cache cannot provide them.
+ *
+ * @param status 400, 404, 500 or 503; other codes get the 500 text.
+ */
+void http_send_error(struct mg_connection *c, struct mg_http_message *hm, int status);
+
+/**
+ * @brief Returns the Content-Encoding token for an encoding (e.g. "gzip").
+ */
+const char *http_encoding_token(ContentEncoding encoding);
+
+/**
+ * @brief Chooses the response encoding from the request's Accept-Encoding header.
+ *
+ * Honors q-values, "*" and explicit exclusions with q=0. Requests without the
+ * header get identity.
+ *
+ * @param hm The HTTP request message.
+ * @param available Bit mask of (1 << ContentEncoding) the content is available in.
+ * @return The preferred acceptable encoding, identity if none is acceptable.
+ */
+ContentEncoding http_negotiate_encoding(struct mg_http_message *hm, unsigned available);
+
+/**
+ * @brief Hands a cache miss to the render pool and parks the request.
+ *
+ * The raw request is copied and the connection is left with a response in
+ * progress, so pipelined requests wait behind it. When the job finishes, the
+ * connection gets MG_EV_WAKEUP and the request is replayed with
+ * http_resume_request(). Replies 503 if the render queue is full, or if the
+ * request was already parked for too long (see http_resume_expired_request()).
+ *
+ * @param c The mongoose connection.
+ * @param hm The HTTP request message.
+ * @param key The argument for the render job.
+ * @param job The render job that fills the cache.
+ */
+void http_defer_to_render_pool(
+    struct mg_connection *c,
+    struct mg_http_message *hm,
+    const char *key,
+    render_job_fn job
+);
+
+/**
+ * @brief Re-parses a deferred request once its render job finished.
+ *
+ * @param c The mongoose connection.
+ * @param wakeup_data The MG_EV_WAKEUP event data, carrying the job's status.
+ * @param hm Receives the parsed request.
+ * @return The buffer `hm` points into, to be passed to http_end_replay() after
+ *         routing, or NULL if there was nothing to replay.
+ */
+char *http_resume_request(struct mg_connection *c, const struct mg_str *wakeup_data,
+                          struct mg_http_message *hm);
+
+/**
+ * @brief Replays a deferred request whose render job has not reported back in time.
+ *
+ * Call on MG_EV_POLL. Once a request has been parked for longer than the
+ * render wait timeout (a lost wakeup, or a job that never finishes), it is
+ * replayed like a fresh request: served if its page is cached by now, otherwise
+ * answered 503 with Retry-After instead of being deferred again.
+ *
+ * @param c The mongoose connection.
+ * @param hm Receives the parsed request.
+ * @return The buffer `hm` points into, to be passed to http_end_replay() after
+ *         routing, or NULL if nothing timed out.
+ */
+char *http_resume_expired_request(struct mg_connection *c, struct mg_http_message *hm);
+
+/**
+ * @brief Ends a replay started with http_resume_request() or
+ *        http_resume_expired_request() and frees its buffer.
+ */
+void http_end_replay(struct mg_connection *c, char *request);
+
+/**
+ * @brief Returns the status of the render job whose request is being replayed.
+ *
+ * @return 0 for a fresh request, otherwise the HTTP status the job reported.
+ */
+int http_render_status(struct mg_connection *c);
+
+/**
+ * @brief Handles connection-level events: activity tracking and the idle timeout.
+ *
+ * Must be called at the end of the event handler for every event, after the
+ * request has been routed.
+ */
+void http_handle_connection_event(struct mg_connection *c, int ev);
+
+/**
+ * @brief Formats a timestamp as an HTTP date (e.g. "Sun, 06 Nov 1994 08:49:37 GMT").
+ *
+ * @param t The timestamp to format.
+ * @param out The output buffer. 32 bytes are always sufficient.
+ * @param size The size of the output buffer.
+ */
+void format_http_date(time_t t, char *out, size_t size);
+
 #endif // HTTP_HELPERS_H
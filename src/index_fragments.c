@@ -0,0 +1,236 @@
+#include "index_fragments.h"
+#include "routes_tree.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// Number of hash buckets for fragments. Must be a power of two.
+#define FRAGMENT_BUCKETS 4096
+
+// The rendered entries of one directory, without the lists of its subdirectories
+typedef struct Fragment {
+    char *path;                     // Relative to md/ with a trailing slash, e.g. "/sub/"
+    uint64_t entries_version;       // MdNode::entries_version the fragment was rendered from
+    char *html;
+    size_t len;
+    size_t *splits;                 // Offsets in `html` where the lists of expanded subdirectories go, in order
+    size_t split_count;
+    GzipPiece *pieces;              // `html` deflated in split_count + 1 pieces, cut at the splits
+    unsigned long pass;             // Last index_fragments_append() call that used the fragment
+    struct Fragment *next;
+} Fragment;
+
+static struct {
+    pthread_mutex_t lock;           // Held for a whole index_fragments_append() call
+    Fragment *buckets[FRAGMENT_BUCKETS];
+    unsigned long pass;
+    int max_depth;                  // Depth the fragments were rendered for
+} s_fragments = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Forward declarations
+static void append_dir(StrBuf *html, GzipStitch *gzip, const MdNode *dir, int depth, char *rel_path,
+                       size_t rel_len);
+static Fragment *get_fragment(const MdNode *dir, int depth, char *rel_path, size_t rel_len);
+static bool render_fragment(Fragment *fragment, const MdNode *dir, int depth, char *rel_path, size_t rel_len);
+static GzipPiece *compress_pieces(const char *html, size_t len, const size_t *splits, size_t split_count);
+static void free_pieces(GzipPiece *pieces, size_t count);
+static size_t child_path(char *rel_path, size_t rel_len, const MdNode *child);
+static bool is_expanded(const MdNode *child, int depth);
+static void drop_unused(void);
+static void free_fragment(Fragment *fragment);
+
+void index_fragments_append(StrBuf *html, GzipStitch *gzip, const MdNode *root, int max_depth) {
+    pthread_mutex_lock(&s_fragments.lock);
+    if (max_depth != s_fragments.max_depth) {
+        // Every fragment depends on it
+        s_fragments.pass++;
+        drop_unused();
+        s_fragments.max_depth = max_depth;
+    }
+    s_fragments.pass++;
+    char rel_path[PATH_MAX] = "/";
+    append_dir(html, gzip, root, 1, rel_path, 1);
+    drop_unused();
+    pthread_mutex_unlock(&s_fragments.lock);
+}
+
+// --- Private helpers ---
+
+// Appends the list of `dir`, which is `depth` levels below md/, by
+// interleaving its fragment with the lists of its expanded subdirectories.
+// `rel_path` is extended in place for them and has room for PATH_MAX bytes.
+static void append_dir(StrBuf *html, GzipStitch *gzip, const MdNode *dir, int depth, char *rel_path,
+                       size_t rel_len) {
+    Fragment *fragment = get_fragment(dir, depth, rel_path, rel_len);
+    if (fragment == NULL) {
+        html->failed = true;
+        if (gzip) gzip->out.failed = true;
+        return;
+    }
+
+    size_t offset = 0, split = 0;
+    for (size_t i = 0; i < dir->child_count && split < fragment->split_count; i++) {
+        const MdNode *child = dir->children[i];
+        size_t child_len = child_path(rel_path, rel_len, child);
+        if (child_len == 0 || !is_expanded(child, depth)) continue;
+
+        str_buf_append_n(html, fragment->html + offset, fragment->splits[split] - offset);
+        if (gzip) gzip_stitch_append(gzip, &fragment->pieces[split]);
+        offset = fragment->splits[split++];
+        rel_path[child_len++] = '/';
+        rel_path[child_len] = '\0';
+        append_dir(html, gzip, child, depth + 1, rel_path, child_len);
+    }
+    rel_path[rel_len] = '\0';
+    str_buf_append_n(html, fragment->html + offset, fragment->len - offset);
+    if (gzip) gzip_stitch_append(gzip, &fragment->pieces[fragment->split_count]);
+}
+
+// Returns the cached fragment of `dir`, rendering it first if its entries changed.
+static Fragment *get_fragment(const MdNode *dir, int depth, char *rel_path, size_t rel_len) {
+    Fragment **bucket = &s_fragments.buckets[hash_string(rel_path) & (FRAGMENT_BUCKETS - 1)];
+    Fragment *fragment = *bucket;
+    while (fragment && strcmp(fragment->path, rel_path) != 0) fragment = fragment->next;
+    if (fragment == NULL) {
+        if ((fragment = calloc(1, sizeof(*fragment))) == NULL) return NULL;
+        if ((fragment->path = strdup(rel_path)) == NULL) {
+            free(fragment);
+            return NULL;
+        }
+        fragment->next = *bucket;
+        *bucket = fragment;
+    } else if (fragment->html && fragment->entries_version == dir->entries_version) {
+        fragment->pass = s_fragments.pass;
+        return fragment;
+    }
+
+    // New, or left unrendered by an earlier allocation failure, in which case drop_unused() frees it
+    if (!render_fragment(fragment, dir, depth, rel_path, rel_len)) return NULL;
+    fragment->entries_version = dir->entries_version;
+    fragment->pass = s_fragments.pass;
+    return fragment;
+}
+
+// Renders the entries of `dir`. Expanded subdirectories get their <details>
+// wrapper, and the position of their list in between is recorded.
+static bool render_fragment(Fragment *fragment, const MdNode *dir, int depth, char *rel_path, size_t rel_len) {
+    StrBuf html;
+    str_buf_init(&html, 64 * (dir->child_count + 1));
+    size_t split_count = 0;
+    for (size_t i = 0; i < dir->child_count; i++) {
+        if (dir->children[i]->is_dir && is_expanded(dir->children[i], depth)) split_count++;
+    }
+    size_t *splits = malloc((split_count ? split_count : 1) * sizeof(size_t));
+    split_count = 0;
+
+    str_buf_append(&html, "<ul>");
+    for (size_t i = 0; splits && i < dir->child_count; i++) {
+        const MdNode *entry = dir->children[i];
+        if (child_path(rel_path, rel_len, entry) == 0) continue;  // Path too long to link to
+
+        if (entry->is_dir && !is_expanded(entry, depth)) {
+            tree_append_lazy_dir(&html, rel_path, entry->name);
+        } else if (entry->is_dir) {
+            // Create a unique ID for the details element based on its path
+            str_buf_append(&html, "<li><details id=\"details-");
+            str_buf_append_html(&html, rel_path);
+            str_buf_append(&html, "\" open><summary>");
+            str_buf_append_html(&html, entry->name);
+            str_buf_append(&html, "</summary>");
+            splits[split_count++] = html.len;
+            str_buf_append(&html, "</details></li>");
+        } else {
+            str_buf_append(&html, "<li><a href=\"/post/");
+            str_buf_append_html(&html, rel_path);
+            str_buf_append(&html, "\"> ");
+            str_buf_append_html(&html, entry->name);
+            str_buf_append(&html, "</a></li>");
+        }
+    }
+    rel_path[rel_len] = '\0';
+    str_buf_append(&html, "</ul>");
+
+    size_t len;
+    char *data = str_buf_detach(&html, &len);
+    GzipPiece *pieces = data && splits ? compress_pieces(data, len, splits, split_count) : NULL;
+    if (pieces == NULL) {
+        free(data);
+        free(splits);
+        return false;
+    }
+    free(fragment->html);
+    free(fragment->splits);
+    free_pieces(fragment->pieces, fragment->split_count + 1);
+    fragment->html = data;
+    fragment->len = len;
+    fragment->splits = splits;
+    fragment->split_count = split_count;
+    fragment->pieces = pieces;
+    return true;
+}
+
+// Deflates the text between consecutive splits as separate pieces.
+static GzipPiece *compress_pieces(const char *html, size_t len, const size_t *splits, size_t split_count) {
+    GzipPiece *pieces = calloc(split_count + 1, sizeof(GzipPiece));
+    if (pieces == NULL) return NULL;
+    size_t start = 0;
+    for (size_t i = 0; i <= split_count; i++) {
+        size_t end = i < split_count ? splits[i] : len;
+        if (!gzip_piece_compress(html + start, end - start, &pieces[i])) {
+            free_pieces(pieces, split_count + 1);
+            return NULL;
+        }
+        start = end;
+    }
+    return pieces;
+}
+
+static void free_pieces(GzipPiece *pieces, size_t count) {
+    if (pieces == NULL) return;
+    for (size_t i = 0; i < count; i++) gzip_piece_free(&pieces[i]);
+    free(pieces);
+}
+
+// Writes the path of `child` after `rel_path` and returns its length, or 0
+// if it doesn't fit, also leaving room for a trailing slash.
+static size_t child_path(char *rel_path, size_t rel_len, const MdNode *child) {
+    int n = snprintf(rel_path + rel_len, PATH_MAX - rel_len, "%s", child->name);
+    if (n < 0 || (size_t) n + 1 >= PATH_MAX - rel_len) {
+        rel_path[rel_len] = '\0';
+        return 0;
+    }
+    return rel_len + (size_t) n;
+}
+
+// Whether a subdirectory of a directory `depth` levels below md/ is listed
+// in place rather than loaded when opened.
+static bool is_expanded(const MdNode *child, int depth) {
+    return child->is_dir && (s_fragments.max_depth == 0 || depth < s_fragments.max_depth);
+}
+
+// Frees the fragments of directories the current pass didn't visit: they were
+// removed, or are no longer listed.
+static void drop_unused(void) {
+    for (size_t i = 0; i < FRAGMENT_BUCKETS; i++) {
+        Fragment **link = &s_fragments.buckets[i];
+        while (*link) {
+            Fragment *fragment = *link;
+            if (fragment->pass == s_fragments.pass) {
+                link = &fragment->next;
+            } else {
+                *link = fragment->next;
+                free_fragment(fragment);
+            }
+        }
+    }
+}
+
+static void free_fragment(Fragment *fragment) {
+    free(fragment->path);
+    free(fragment->html);
+    free(fragment->splits);
+    free_pieces(fragment->pieces, fragment->split_count + 1);
+    free(fragment);
+}
@@ -0,0 +1,29 @@
+#ifndef INDEX_FRAGMENTS_H
+#define INDEX_FRAGMENTS_H
+
+#include "md_tree.h"
+#include "str_buf.h"
+#include "gzip_stitch.h"
+
+/**
+ * @brief Appends the index's nested file list for the tree below `root`.
+ *
+ * Each directory's own entries are rendered once and kept as a fragment,
+ * keyed by the directory's entries_version. A call only renders the
+ * directories whose entries changed since the previous one; everything else
+ * is copied from the cached fragments. Fragments of directories that are no
+ * longer listed are dropped.
+ *
+ * Each fragment is also kept deflated, in pieces split where the lists of
+ * subdirectories go, so the gzip encoding of the list is stitched together
+ * from them as well: only the changed directories are compressed again.
+ *
+ * The caller must hold the tree's read lock (md_tree_acquire()).
+ *
+ * @param gzip Receives the list's pieces, after whatever was appended to it before. May be NULL.
+ * @param max_depth Levels to list; deeper directories are emitted closed, to be
+ *                  loaded from /api/tree. 0 lists everything.
+ */
+void index_fragments_append(StrBuf *html, GzipStitch *gzip, const MdNode *root, int max_depth);
+
+#endif // INDEX_FRAGMENTS_H
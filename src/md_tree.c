@@ -0,0 +1,409 @@
+#include "md_tree.h"
+#include "watcher.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// Without the watcher, the tree is rebuilt at most this often, in seconds
+#define POLL_INTERVAL 1
+// Entry versions start at the startup time shifted by this much, which leaves
+// room for 2^24 versions per second of uptime before a later run could reuse one
+#define VERSION_TIME_SHIFT 24
+
+static struct {
+    pthread_rwlock_t lock;      // Protects `root` and `built`
+    char root_path[PATH_MAX];
+    size_t root_len;
+    MdNode *root;               // NULL if md/ doesn't exist
+    bool built;                 // Changes reported before the first scan are covered by it
+    pthread_mutex_t poll_lock;  // Protects the fields below, up to `last_scan`
+    pthread_cond_t poll_wanted;
+    bool poll_requested;
+    bool poll_thread_started;
+    time_t last_scan;
+    _Atomic uint64_t last_entries_version;
+} s_tree = { .lock = PTHREAD_RWLOCK_INITIALIZER, .poll_lock = PTHREAD_MUTEX_INITIALIZER,
+             .poll_wanted = PTHREAD_COND_INITIALIZER };
+
+// A change to one entry of a directory, read from the filesystem before the
+// tree is locked to apply it
+typedef struct {
+    bool has_dir_mtime;
+    time_t dir_mtime;
+    bool file_updated;          // The entry is a known file that still exists
+    time_t mtime;
+    off_t size;
+    MdNode *node;               // Otherwise the entry scanned again, NULL if it's gone
+} EntryChange;
+
+// Forward declarations
+static void on_change(const char *path);
+static void poll_if_unwatched(void);
+static void *poll_thread(void *arg);
+static void rescan(void);
+static MdNode *scan_node(const char *path, const char *name);
+static void sync_path(const char *rel);
+static void read_entry(EntryChange *change, const MdNode *dir, const char *dir_path, const char *name);
+static MdNode *apply_entry(const EntryChange *change, MdNode *dir, const char *name);
+static MdNode *find_child(const MdNode *dir, const char *name, size_t *index);
+static bool insert_child(MdNode *dir, MdNode *child, size_t index);
+static uint64_t next_version(void);
+static void update_latest(MdNode *node);
+static void keep_versions(MdNode *node, const MdNode *old);
+static bool same_entries(const MdNode *a, const MdNode *b);
+static void free_node(MdNode *node);
+
+void md_tree_init(const char *md_dir_path) {
+    snprintf(s_tree.root_path, sizeof(s_tree.root_path), "%s", md_dir_path);
+    s_tree.root_len = strlen(s_tree.root_path);
+    watcher_set_listener(on_change);
+    // Versions continue from the startup time, so that content cached by an
+    // earlier run (e.g. in cache/) never matches a version of this one
+    atomic_store(&s_tree.last_entries_version, (uint64_t) time(NULL) << VERSION_TIME_SHIFT);
+
+    // Scanning under the lock makes changes reported meanwhile wait for the
+    // scan and be applied on top of it
+    pthread_rwlock_wrlock(&s_tree.lock);
+    s_tree.root = scan_node(s_tree.root_path, "");
+    s_tree.built = true;
+    pthread_rwlock_unlock(&s_tree.lock);
+    s_tree.last_scan = time(NULL);
+}
+
+uint64_t md_tree_version(time_t *latest_mtime) {
+    poll_if_unwatched();
+    pthread_rwlock_rdlock(&s_tree.lock);
+    uint64_t version = s_tree.root ? s_tree.root->latest_version : 0;
+    *latest_mtime = s_tree.root ? s_tree.root->latest_mtime : 0;
+    pthread_rwlock_unlock(&s_tree.lock);
+    return version;
+}
+
+const MdNode *md_tree_acquire(void) {
+    poll_if_unwatched();
+    pthread_rwlock_rdlock(&s_tree.lock);
+    return s_tree.root;
+}
+
+const MdNode *md_tree_find(const MdNode *root, const char *rel_path) {
+    const MdNode *node = root;
+    const char *p = rel_path;
+    while (node && *p) {
+        if (*p == '/') {
+            p++;
+            continue;
+        }
+        size_t len = strcspn(p, "/");
+        char name[NAME_MAX + 1];
+        if (!node->is_dir || len > NAME_MAX) return NULL;
+        memcpy(name, p, len);
+        name[len] = '\0';
+        node = find_child(node, name, NULL);
+        p += len;
+    }
+    return node;
+}
+
+void md_tree_release(void) {
+    pthread_rwlock_unlock(&s_tree.lock);
+}
+
+// --- Private helpers ---
+
+// Watcher listener: applies one change to the tree. `path` is NULL when
+// events were lost.
+static void on_change(const char *path) {
+    bool below_root = path != NULL && strncmp(path, s_tree.root_path, s_tree.root_len) == 0 &&
+                      path[s_tree.root_len] == '/';
+    if (path != NULL && !below_root && strcmp(path, s_tree.root_path) != 0) return;  // E.g. templates/
+
+    pthread_rwlock_rdlock(&s_tree.lock);
+    bool built = s_tree.built;
+    pthread_rwlock_unlock(&s_tree.lock);
+    if (!built) return;
+
+    // Only the watcher thread changes the tree while the watcher runs, so it
+    // reads the tree unlocked and takes the write lock just to apply what it
+    // read from the filesystem beforehand
+    if (below_root && s_tree.root) {
+        sync_path(path + s_tree.root_len + 1);
+    } else {
+        // md/ itself changed, or we can't tell what did
+        rescan();
+    }
+}
+
+// Without the watcher there is no way to know what changed: have the poll
+// thread rebuild the whole tree once the current one is POLL_INTERVAL old.
+// Readers keep using the current tree meanwhile.
+static void poll_if_unwatched(void) {
+    if (watcher_is_active()) return;
+    pthread_mutex_lock(&s_tree.poll_lock);
+    if (!s_tree.poll_requested && time(NULL) - s_tree.last_scan >= POLL_INTERVAL) {
+        // Started on first use, as the watcher may also stop after startup
+        if (!s_tree.poll_thread_started) {
+            pthread_t thread;
+            s_tree.poll_thread_started = pthread_create(&thread, NULL, poll_thread, NULL) == 0;
+            if (s_tree.poll_thread_started) pthread_detach(thread);
+        }
+        if (s_tree.poll_thread_started) {
+            s_tree.poll_requested = true;
+            pthread_cond_signal(&s_tree.poll_wanted);
+        } else {
+            rescan();
+            s_tree.last_scan = time(NULL);
+        }
+    }
+    pthread_mutex_unlock(&s_tree.poll_lock);
+}
+
+static void *poll_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&s_tree.poll_lock);
+    for (;;) {
+        while (!s_tree.poll_requested) pthread_cond_wait(&s_tree.poll_wanted, &s_tree.poll_lock);
+        pthread_mutex_unlock(&s_tree.poll_lock);
+        rescan();
+        pthread_mutex_lock(&s_tree.poll_lock);
+        s_tree.last_scan = time(NULL);
+        s_tree.poll_requested = false;
+    }
+    return NULL;
+}
+
+// Rebuilds the whole tree and swaps it in. Must only be called by the thread
+// that changes the tree (the watcher or the poll thread), which can read the
+// current tree without the lock.
+static void rescan(void) {
+    MdNode *root = scan_node(s_tree.root_path, "");
+    keep_versions(root, s_tree.root);
+    pthread_rwlock_wrlock(&s_tree.lock);
+    MdNode *old_root = s_tree.root;
+    s_tree.root = root;
+    pthread_rwlock_unlock(&s_tree.lock);
+    free_node(old_root);
+}
+
+static bool is_markdown(const char *name) {
+    const char *ext = strrchr(name, '.');
+    return ext && strcmp(ext, ".md") == 0;
+}
+
+static int compare_nodes(const void *a, const void *b) {
+    return strcmp((*(MdNode *const *) a)->name, (*(MdNode *const *) b)->name);
+}
+
+// Builds the node for `path` and, for a directory, everything below it.
+// Returns NULL if it doesn't exist or doesn't belong in the tree.
+static MdNode *scan_node(const char *path, const char *name) {
+    struct stat st;
+    if (stat(path, &st) != 0) return NULL;
+    bool is_dir = S_ISDIR(st.st_mode);
+    if (!is_dir && !is_markdown(name)) return NULL;
+
+    MdNode *node = calloc(1, sizeof(*node));
+    if (node == NULL) return NULL;
+    if ((node->name = strdup(name)) == NULL) {
+        free(node);
+        return NULL;
+    }
+    node->is_dir = is_dir;
+    node->mtime = st.st_mtime;
+    node->size = st.st_size;
+    if (is_dir) node->entries_version = next_version();
+
+    DIR *dir = is_dir ? opendir(path) : NULL;
+    if (dir) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.') continue;
+            char child_path[PATH_MAX];
+            snprintf(child_path, sizeof(child_path), "%s/%s", path, entry->d_name);
+            MdNode *child = scan_node(child_path, entry->d_name);
+            if (child && !insert_child(node, child, node->child_count)) free_node(child);
+        }
+        closedir(dir);
+        qsort(node->children, node->child_count, sizeof(MdNode *), compare_nodes);
+    }
+    update_latest(node);
+    return node;
+}
+
+// Brings the entry at `rel` (relative to md/) in line with the filesystem.
+// Called on the watcher thread, see on_change().
+static void sync_path(const char *rel) {
+    // Each path component is at least one character and a slash
+    MdNode *parents[PATH_MAX / 2];
+    size_t depth = 0;
+    char dir_path[PATH_MAX];
+    memcpy(dir_path, s_tree.root_path, s_tree.root_len + 1);
+    size_t dir_len = s_tree.root_len;
+    MdNode *dir = s_tree.root;
+    char name[NAME_MAX + 1];
+    for (;;) {
+        const char *slash = strchr(rel, '/');
+        size_t name_len = slash ? (size_t) (slash - rel) : strlen(rel);
+        if (name_len == 0 || name_len > NAME_MAX) return;
+        memcpy(name, rel, name_len);
+        name[name_len] = '\0';
+        if (name[0] == '.') return;
+
+        // The last component, or a directory we didn't know about, whose scan
+        // picks up everything below
+        MdNode *child = find_child(dir, name, NULL);
+        if (!slash || !child || !child->is_dir) break;
+        int n = snprintf(dir_path + dir_len, PATH_MAX - dir_len, "/%s", name);
+        if (n < 0 || (size_t) n >= PATH_MAX - dir_len) return;
+        dir_len += (size_t) n;
+        parents[depth++] = dir;
+        dir = child;
+        rel = slash + 1;
+    }
+
+    EntryChange change;
+    read_entry(&change, dir, dir_path, name);
+    pthread_rwlock_wrlock(&s_tree.lock);
+    MdNode *removed = apply_entry(&change, dir, name);
+    update_latest(dir);
+    while (depth > 0) update_latest(parents[--depth]);
+    pthread_rwlock_unlock(&s_tree.lock);
+    free_node(removed);
+}
+
+// Reads the entry `name` of `dir` from the filesystem. Files only need a
+// stat(); directories are scanned again, since one moved into the tree brings
+// its contents along without any events for them.
+static void read_entry(EntryChange *change, const MdNode *dir, const char *dir_path, const char *name) {
+    memset(change, 0, sizeof(*change));
+    // An entry was added, removed or changed, so the directory's mtime may have too
+    struct stat st;
+    if (stat(dir_path, &st) == 0) {
+        change->has_dir_mtime = true;
+        change->dir_mtime = st.st_mtime;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir_path, name);
+    const MdNode *child = find_child(dir, name, NULL);
+    if (child && !child->is_dir && stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+        change->file_updated = true;
+        change->mtime = st.st_mtime;
+        change->size = st.st_size;
+        return;
+    }
+    change->node = scan_node(path, name);
+}
+
+// Applies a change read by read_entry(). Called with the write lock held.
+// Returns the node it took out of the tree, to be freed after unlocking.
+static MdNode *apply_entry(const EntryChange *change, MdNode *dir, const char *name) {
+    if (change->has_dir_mtime) dir->mtime = change->dir_mtime;
+    size_t index;
+    MdNode *child = find_child(dir, name, &index);
+    if (change->file_updated) {
+        // The size and mtime are listed by /api/tree
+        if (child->mtime != change->mtime || child->size != change->size) {
+            dir->entries_version = next_version();
+        }
+        child->mtime = child->latest_mtime = child->contents_mtime = change->mtime;
+        child->size = change->size;
+        return NULL;
+    }
+
+    MdNode *node = change->node;
+    if (child == NULL && node == NULL) return NULL;  // Not part of the tree, e.g. a .txt file
+    dir->entries_version = next_version();
+    if (child) {
+        if (node) {
+            dir->children[index] = node;
+            return child;
+        }
+        memmove(&dir->children[index], &dir->children[index + 1],
+                (dir->child_count - index - 1) * sizeof(MdNode *));
+        dir->child_count--;
+        return child;
+    }
+    return insert_child(dir, node, index) ? NULL : node;
+}
+
+// Binary search among the sorted children. Sets `index` to the position of
+// `name`, or to where it would be inserted.
+static MdNode *find_child(const MdNode *dir, const char *name, size_t *index) {
+    size_t lo = 0, hi = dir->child_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(dir->children[mid]->name, name);
+        if (cmp == 0) {
+            if (index) *index = mid;
+            return dir->children[mid];
+        }
+        if (cmp < 0) lo = mid + 1; else hi = mid;
+    }
+    if (index) *index = lo;
+    return NULL;
+}
+
+static bool insert_child(MdNode *dir, MdNode *child, size_t index) {
+    if (dir->child_count == dir->child_capacity) {
+        size_t capacity = dir->child_capacity ? dir->child_capacity * 2 : 8;
+        MdNode **children = realloc(dir->children, capacity * sizeof(MdNode *));
+        if (children == NULL) return false;
+        dir->children = children;
+        dir->child_capacity = capacity;
+    }
+    memmove(&dir->children[index + 1], &dir->children[index],
+            (dir->child_count - index) * sizeof(MdNode *));
+    dir->children[index] = child;
+    dir->child_count++;
+    return true;
+}
+
+static uint64_t next_version(void) {
+    return atomic_fetch_add(&s_tree.last_entries_version, 1) + 1;
+}
+
+static void update_latest(MdNode *node) {
+    node->latest_mtime = node->contents_mtime = node->mtime;
+    node->latest_version = node->entries_version;
+    for (size_t i = 0; i < node->child_count; i++) {
+        const MdNode *child = node->children[i];
+        if (child->latest_mtime > node->latest_mtime) node->latest_mtime = child->latest_mtime;
+        if (child->latest_version > node->latest_version) node->latest_version = child->latest_version;
+        if (child->mtime > node->contents_mtime) node->contents_mtime = child->mtime;
+    }
+}
+
+// Gives the directories of a rescanned tree the versions they had in `old`
+// where their entries are the same, so that a rescan alone doesn't make
+// content built from the tree outdated.
+static void keep_versions(MdNode *node, const MdNode *old) {
+    if (node == NULL || old == NULL || !node->is_dir || !old->is_dir) return;
+    for (size_t i = 0; i < node->child_count; i++) {
+        keep_versions(node->children[i], find_child(old, node->children[i]->name, NULL));
+    }
+    if (same_entries(node, old)) node->entries_version = old->entries_version;
+    update_latest(node);
+}
+
+static bool same_entries(const MdNode *a, const MdNode *b) {
+    if (a->child_count != b->child_count) return false;
+    for (size_t i = 0; i < a->child_count; i++) {
+        const MdNode *x = a->children[i], *y = b->children[i];
+        if (strcmp(x->name, y->name) != 0 || x->is_dir != y->is_dir) return false;
+        if (!x->is_dir && (x->mtime != y->mtime || x->size != y->size)) return false;
+    }
+    return true;
+}
+
+static void free_node(MdNode *node) {
+    if (node == NULL) return;
+    for (size_t i = 0; i < node->child_count; i++) free_node(node->children[i]);
+    free(node->children);
+    free(node->name);
+    free(node);
+}
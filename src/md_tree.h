@@ -0,0 +1,80 @@
+#ifndef MD_TREE_H
+#define MD_TREE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+/**
+ * @brief A directory or Markdown file below md/.
+ *
+ * Hidden entries (names starting with '.') and files that aren't .md are not
+ * part of the tree.
+ */
+typedef struct MdNode {
+    char *name;
+    bool is_dir;
+    time_t mtime;
+    off_t size;
+    time_t latest_mtime;        // Latest mtime of the node and everything below it
+    time_t contents_mtime;      // Latest mtime of the node and its direct children
+    uint64_t entries_version;   // Directories: changes whenever an entry is added, removed,
+                                // replaced or modified. Never reused, even across restarts. 0 for files
+    uint64_t latest_version;    // Highest entries_version of the node and everything below it
+    struct MdNode **children;   // Directories only, sorted by name
+    size_t child_count;
+    size_t child_capacity;
+} MdNode;
+
+/**
+ * @brief Builds the in-memory model of the md/ tree and keeps it current.
+ *
+ * Call once at startup, after watcher_start(). While the file watcher is active,
+ * each change it reports is applied to the model on the watcher thread, so
+ * readers never touch the filesystem. Without the watcher, reading the model
+ * has a background thread rebuild it, at most once per second. Either way the
+ * filesystem is read before the model is locked, and readers only wait for
+ * the finished change to be swapped in.
+ *
+ * @param md_dir_path Absolute path of the md/ directory.
+ */
+void md_tree_init(const char *md_dir_path);
+
+/**
+ * @brief Returns the version of the whole tree, or 0 if md/ doesn't exist.
+ *
+ * Changes whenever a directory or Markdown file is added, removed or modified,
+ * also within the same second, so it can key content built from the tree.
+ *
+ * @param latest_mtime Receives the latest mtime in the tree, e.g. for Last-Modified.
+ */
+uint64_t md_tree_version(time_t *latest_mtime);
+
+/**
+ * @brief Locks the tree for reading and returns its root.
+ *
+ * Updates wait until md_tree_release(), so keep the lock briefly.
+ *
+ * @return The md/ directory node, or NULL if md/ doesn't exist. Either way,
+ *         md_tree_release() must be called.
+ */
+const MdNode *md_tree_acquire(void);
+
+/**
+ * @brief Looks up a node by its path relative to md/, e.g. "/sub/post.md".
+ *
+ * Empty components are ignored, so "" and "/" name the root. Must be called
+ * between md_tree_acquire() and md_tree_release().
+ *
+ * @return The node, or NULL if there is none (hidden entries never match).
+ */
+const MdNode *md_tree_find(const MdNode *root, const char *rel_path);
+
+/**
+ * @brief Releases the lock taken by md_tree_acquire().
+ */
+void md_tree_release(void);
+
+#endif // MD_TREE_H
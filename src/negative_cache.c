@@ -0,0 +1,87 @@
+#include "negative_cache.h"
+#include "watcher.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// Number of remembered failures. Must be a power of two.
+#define NEGATIVE_CACHE_SLOTS 4096
+// Seconds a missing source is remembered
+#define NOT_FOUND_TTL 30
+// Seconds a render failure is remembered; it may have been transient
+#define RENDER_ERROR_TTL 5
+
+typedef struct {
+    char *path;                 // NULL for an empty slot
+    int status;
+    time_t expires;
+    time_t source_mtime;        // For render failures: mtime of the source that failed
+    unsigned long generation;   // Watcher generation when the failure was recorded
+} NegativeEntry;
+
+static struct {
+    pthread_mutex_t lock;
+    NegativeEntry slots[NEGATIVE_CACHE_SLOTS];
+} s_negative = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Forward declarations
+static bool entry_is_valid(const NegativeEntry *entry, const char *path);
+static void clear_slot(NegativeEntry *entry);
+
+void negative_cache_add(const char *path, int status) {
+    // Capture the generation before looking at the file, so that a change made
+    // meanwhile still invalidates the entry
+    unsigned long generation = watcher_generation();
+    struct stat st;
+    time_t source_mtime = stat(path, &st) == 0 ? st.st_mtime : 0;
+    char *copy = strdup(path);
+    if (!copy) return;
+
+    pthread_mutex_lock(&s_negative.lock);
+    NegativeEntry *entry = &s_negative.slots[hash_string(path) & (NEGATIVE_CACHE_SLOTS - 1)];
+    free(entry->path);
+    entry->path = copy;
+    entry->status = status;
+    entry->expires = time(NULL) + (status == 404 ? NOT_FOUND_TTL : RENDER_ERROR_TTL);
+    entry->source_mtime = source_mtime;
+    entry->generation = generation;
+    pthread_mutex_unlock(&s_negative.lock);
+}
+
+int negative_cache_lookup(const char *path) {
+    NegativeEntry *slot = &s_negative.slots[hash_string(path) & (NEGATIVE_CACHE_SLOTS - 1)];
+    NegativeEntry found = { 0 };
+    pthread_mutex_lock(&s_negative.lock);
+    if (slot->path && strcmp(slot->path, path) == 0) found = *slot;
+    pthread_mutex_unlock(&s_negative.lock);
+    if (!found.path) return 0;
+
+    // Validate on a copy, so that the lock is never held across a stat()
+    if (entry_is_valid(&found, path)) return found.status;
+
+    pthread_mutex_lock(&s_negative.lock);
+    if (slot->path == found.path) clear_slot(slot);
+    pthread_mutex_unlock(&s_negative.lock);
+    return 0;
+}
+
+// --- Private helpers ---
+
+static bool entry_is_valid(const NegativeEntry *entry, const char *path) {
+    if (time(NULL) > entry->expires) return false;
+    if (watcher_is_active()) {
+        // Also catches a parent directory being created or renamed
+        return watcher_path_generation(path) <= entry->generation;
+    }
+    struct stat st;
+    if (entry->status == 404) return stat(path, &st) != 0;
+    return stat(path, &st) == 0 && st.st_mtime == entry->source_mtime;
+}
+
+static void clear_slot(NegativeEntry *entry) {
+    free(entry->path);
+    memset(entry, 0, sizeof(*entry));
+}
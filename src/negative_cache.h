@@ -0,0 +1,25 @@
+#ifndef NEGATIVE_CACHE_H
+#define NEGATIVE_CACHE_H
+
+/**
+ * @brief Remembers that a source recently could not be served.
+ *
+ * Lets repeated requests for missing posts (e.g. from scanners) and for
+ * posts that fail to render be answered without another render job. The
+ * table has a fixed number of slots; a new failure may replace an older one.
+ *
+ * @param path Absolute path of the source.
+ * @param status 404 if the source doesn't exist, 500 if it failed to render.
+ */
+void negative_cache_add(const char *path, int status);
+
+/**
+ * @brief Returns the status remembered for `path`, or 0.
+ *
+ * Entries expire after a few seconds, and as soon as the source appears or
+ * changes: while the file watcher is active, that takes no filesystem access;
+ * otherwise one stat() decides.
+ */
+int negative_cache_lookup(const char *path);
+
+#endif // NEGATIVE_CACHE_H
@@ -0,0 +1,199 @@
+#include "render_pool.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Number of hash buckets for in-flight jobs. Must be a power of two.
+#define INFLIGHT_BUCKETS 256
+// Nice value of the background thread, so it only gets CPU time the renders leave over
+#define BACKGROUND_NICE 10
+
+// A connection waiting for a job
+typedef struct {
+    struct mg_mgr *mgr;
+    unsigned long conn_id;
+} RenderWaiter;
+
+typedef struct RenderJob {
+    char *key;
+    render_job_fn fn;
+    RenderWaiter *waiters;
+    int num_waiters, waiters_capacity;
+    struct RenderJob *next;         // Next in the FIFO queue
+    struct RenderJob *inflight_next; // Next in the in-flight bucket
+} RenderJob;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    RenderJob *head, *tail;     // FIFO queue
+    // Queued and running jobs by key, so concurrent misses share one render
+    RenderJob *inflight[INFLIGHT_BUCKETS];
+    int queued;
+    int capacity;               // 0 for no limit
+    bool running;
+} JobQueue;
+
+// Renders for requests, and the background queue with its own thread, so
+// that slow optional work can neither delay nor crowd out a render
+static JobQueue s_pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .not_empty = PTHREAD_COND_INITIALIZER };
+static JobQueue s_background = { .lock = PTHREAD_MUTEX_INITIALIZER, .not_empty = PTHREAD_COND_INITIALIZER };
+
+// Forward declarations
+static bool start_threads(JobQueue *queue, int threads, int capacity);
+static bool submit(JobQueue *queue, struct mg_mgr *mgr, unsigned long conn_id, const char *key,
+                   render_job_fn fn);
+static void *render_thread(void *arg);
+static bool add_waiter(RenderJob *job, struct mg_mgr *mgr, unsigned long conn_id);
+static void free_job(RenderJob *job);
+
+bool render_pool_start(int threads, int queue_capacity) {
+    if (!start_threads(&s_pool, threads, queue_capacity)) return false;
+    // Each key is queued at most once, so the background queue is bounded by
+    // the number of cache entries and needs no limit of its own
+    if (!start_threads(&s_background, 1, 0)) {
+        fprintf(stderr, "Background thread unavailable, optional compression disabled\n");
+    }
+    return true;
+}
+
+bool render_pool_submit(struct mg_mgr *mgr, unsigned long conn_id, const char *key, render_job_fn fn) {
+    return submit(&s_pool, mgr, conn_id, key, fn);
+}
+
+bool render_pool_submit_background(const char *key, render_job_fn fn) {
+    return submit(&s_background, NULL, 0, key, fn);
+}
+
+// --- Private helpers ---
+
+static bool start_threads(JobQueue *queue, int threads, int capacity) {
+    queue->capacity = capacity;
+    for (int i = 0; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, render_thread, queue) != 0) {
+            perror("render pool");
+            return i > 0;
+        }
+        pthread_detach(thread);
+        queue->running = true;
+    }
+    return queue->running;
+}
+
+static bool submit(JobQueue *queue, struct mg_mgr *mgr, unsigned long conn_id, const char *key,
+                   render_job_fn fn) {
+    unsigned long bucket = hash_string(key) & (INFLIGHT_BUCKETS - 1);
+
+    pthread_mutex_lock(&queue->lock);
+    if (!queue->running) {
+        pthread_mutex_unlock(&queue->lock);
+        return false;
+    }
+    // Join a queued or running job for the same key instead of rendering twice.
+    // If that job turns out to have rendered an older version, the replayed
+    // request misses again and submits a fresh job, shared by all late arrivals.
+    for (RenderJob *job = queue->inflight[bucket]; job; job = job->inflight_next) {
+        if (job->fn == fn && strcmp(job->key, key) == 0) {
+            bool ok = mgr == NULL || add_waiter(job, mgr, conn_id);
+            pthread_mutex_unlock(&queue->lock);
+            return ok;
+        }
+    }
+    if (queue->capacity > 0 && queue->queued >= queue->capacity) {
+        pthread_mutex_unlock(&queue->lock);
+        return false;
+    }
+
+    RenderJob *job = calloc(1, sizeof(*job));
+    if (!job || !(job->key = strdup(key)) || (mgr != NULL && !add_waiter(job, mgr, conn_id))) {
+        pthread_mutex_unlock(&queue->lock);
+        free_job(job);
+        return false;
+    }
+    job->fn = fn;
+    job->inflight_next = queue->inflight[bucket];
+    queue->inflight[bucket] = job;
+
+    if (queue->tail) queue->tail->next = job;
+    else queue->head = job;
+    queue->tail = job;
+    queue->queued++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+    return true;
+}
+
+// Called with the lock held
+static bool add_waiter(RenderJob *job, struct mg_mgr *mgr, unsigned long conn_id) {
+    if (job->num_waiters == job->waiters_capacity) {
+        int capacity = job->waiters_capacity ? job->waiters_capacity * 2 : 4;
+        RenderWaiter *waiters = realloc(job->waiters, capacity * sizeof(*waiters));
+        if (!waiters) return false;
+        job->waiters = waiters;
+        job->waiters_capacity = capacity;
+    }
+    job->waiters[job->num_waiters].mgr = mgr;
+    job->waiters[job->num_waiters].conn_id = conn_id;
+    job->num_waiters++;
+    return true;
+}
+
+static void free_job(RenderJob *job) {
+    if (!job) return;
+    free(job->waiters);
+    free(job->key);
+    free(job);
+}
+
+static void *render_thread(void *arg) {
+    JobQueue *queue = arg;
+#ifdef __linux__
+    // Linux applies nice values per thread
+    if (queue == &s_background) setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), BACKGROUND_NICE);
+#endif
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        while (!queue->head) pthread_cond_wait(&queue->not_empty, &queue->lock);
+        RenderJob *job = queue->head;
+        queue->head = job->next;
+        if (!queue->head) queue->tail = NULL;
+        queue->queued--;
+        pthread_mutex_unlock(&queue->lock);
+
+        int status = job->fn(job->key);
+
+        // Retire the job before waking anyone, so that no waiter joins after the
+        // list below was taken
+        pthread_mutex_lock(&queue->lock);
+        RenderJob **pp = &queue->inflight[hash_string(job->key) & (INFLIGHT_BUCKETS - 1)];
+        while (*pp != job) pp = &(*pp)->inflight_next;
+        *pp = job->inflight_next;
+        pthread_mutex_unlock(&queue->lock);
+
+        // If a connection closed in the meantime, its wakeup is simply dropped.
+        // mg_wakeup() fails only when the event loop has no wakeup pipe, and a
+        // datagram lost on the way isn't reported at all; in both cases the
+        // waiting request is replayed once it has waited too long, see
+        // http_resume_expired_request().
+        int failed = 0;
+        for (int i = 0; i < job->num_waiters; i++) {
+            if (!mg_wakeup(job->waiters[i].mgr, job->waiters[i].conn_id, &status, sizeof(status))) {
+                failed++;
+            }
+        }
+        if (failed > 0) {
+            fprintf(stderr, "Render pool: %d of %d wakeups for %s could not be sent\n",
+                    failed, job->num_waiters, job->key);
+        }
+        free_job(job);
+    }
+    return NULL;
+}
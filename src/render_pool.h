@@ -0,0 +1,56 @@
+#ifndef RENDER_POOL_H
+#define RENDER_POOL_H
+
+#include "mongoose.h"
+#include <stdbool.h>
+
+/**
+ * @brief A render job. Runs on a pool thread and fills the cache for `key`.
+ *
+ * @param key The job argument, usually the absolute source path.
+ * @return An HTTP status: 200 if the content is now cached, otherwise the error to report.
+ */
+typedef int (*render_job_fn)(const char *key);
+
+/**
+ * @brief Starts the render thread pool.
+ *
+ * @param threads Number of render threads.
+ * @param queue_capacity Maximum number of queued jobs; further submissions are rejected.
+ * @return true on success.
+ */
+bool render_pool_start(int threads, int queue_capacity);
+
+/**
+ * @brief Queues a render job for a connection.
+ *
+ * Requests for a key that is already queued or being rendered join that job
+ * instead of starting another one, so each key is rendered once no matter how
+ * many connections miss on it at the same time.
+ *
+ * When the job finishes, every waiting connection receives an MG_EV_WAKEUP
+ * event whose data is the int status returned by the job. The event loop owning `mgr`
+ * must have called mg_wakeup_init(). A wakeup can't be delivered reliably (it
+ * is a datagram), so callers must not wait for it without a deadline.
+ *
+ * @param mgr The event manager the connection belongs to, or NULL for a
+ *            background job that nobody waits for.
+ * @param conn_id The id of the connection to wake up.
+ * @param key The job argument. It is copied.
+ * @param fn The function to run.
+ * @return false if the queue is full or the pool is not running.
+ */
+bool render_pool_submit(struct mg_mgr *mgr, unsigned long conn_id, const char *key, render_job_fn fn);
+
+/**
+ * @brief Queues a low-priority job that nobody waits for, e.g. optional compression.
+ *
+ * Background jobs run one at a time on their own thread, at a lower CPU
+ * priority where supported, so they never hold up or take queue slots from
+ * render_pool_submit(). Like there, a key that is already queued is not queued again.
+ *
+ * @return false if the background thread is not running.
+ */
+bool render_pool_submit_background(const char *key, render_job_fn fn);
+
+#endif // RENDER_POOL_H
@@ -4,5 +4,6 @@
 // Include all route handlers
 #include "routes_index.h"
 #include "routes_post.h"
+#include "routes_tree.h"
 
 #endif // ROUTES_H
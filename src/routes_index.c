@@ -1,218 +1,212 @@
 #include "routes_index.h"
 #include "utils.h"
 #include "http_helpers.h"
+#include "cache.h"
+#include "md_tree.h"
+#include "str_buf.h"
+#include "index_fragments.h"
+#include "gzip_stitch.h"
+#include "render_pool.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <dirent.h>
-#include <sys/stat.h>
-#include <zlib.h>
-
-// Forward declaration
-static char* generate_index_html();
+#include <pthread.h>
+
+// Bump whenever generate_index_html() produces different markup, so that
+// cached copies of the old index are rebuilt.
+#define INDEX_MARKUP_VERSION 2
+
+#define FILE_LIST_PLACEHOLDER "{{FILE_LIST}}"
+
+// Precompressed halves of the index template around the placeholder
+static struct {
+    pthread_mutex_t lock;       // Held while an index is assembled
+    bool valid;
+    uint64_t template_hash;     // hash64() of the template the pieces were cut from
+    GzipPiece head, tail;
+    size_t last_html_size;      // Sizes of the previous index, to size the buffers
+    size_t last_gzip_size;
+} s_template_pieces = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Levels of the tree the index lists; deeper directories are loaded from
+// /api/tree when opened. 0 lists everything.
+static int s_index_depth;
+
+// Forward declarations
+static CacheDeps index_deps(char *template_path, size_t size);
+static char* generate_index_html(const char *md_dir_path, size_t *html_size);
+static char* generate_index_unstitched(const char *template_content, size_t template_size, size_t *html_size);
+static bool update_template_pieces(const char *template_content, size_t template_size, size_t head_len);
 
 // Serves the homepage with a collapsible file tree of the md/ directory.
 void serve_index(struct mg_connection *c, struct mg_http_message *hm) {
     char md_dir_path[PATH_MAX];
     snprintf(md_dir_path, sizeof(md_dir_path), "%s/md", g_project_root);
 
-    time_t latest_mtime = get_latest_mtime_in_dir(md_dir_path);
-    if (latest_mtime == 0) {
-        mg_http_reply(c, 200, "Content-Type: text/html; charset=utf-8\r\n", "<h1>No markdown files found.</h1>");
+    // The version comes from the in-memory tree, so checking it never touches the disk
+    time_t latest_mtime;
+    uint64_t version = md_tree_version(&latest_mtime);
+    if (version == 0) {
+        http_reply(c, 200, "Content-Type: text/html; charset=utf-8\r\n", "<h1>No markdown files found.</h1>");
         return;
     }
 
-    char etag[64];
-    snprintf(etag, sizeof(etag), "\"%lx\"", (unsigned long)latest_mtime);
-
-    if (handle_conditional_request(c, hm, etag, latest_mtime)) {
+    char template_path[PATH_MAX];
+    CacheDeps deps = index_deps(template_path, sizeof(template_path));
+    CacheResult cache_result = get_cached_version(md_dir_path, latest_mtime, version, &deps);
+    if (cache_result.content == NULL) {
+        int status = http_render_status(c);
+        if (status == 0 || status == 200) {
+            // Build the index on the render pool; the request is replayed when it's cached
+            http_defer_to_render_pool(c, hm, md_dir_path, render_index);
+        } else {
+            http_send_error(c, hm, 500);
+        }
         return;
     }
 
-    char cache_path[PATH_MAX];
-    snprintf(cache_path, sizeof(cache_path), "%s/cache/__index.html.gz", g_project_root);
-    
-    struct stat st;
-    if (stat(cache_path, &st) == 0 && st.st_mtime >= latest_mtime) {
-        size_t compressed_size;
-        char *compressed_content = read_file_content(cache_path, &compressed_size);
-        if (compressed_content) {
-            char last_modified_str[100];
-            struct tm *tm = gmtime(&latest_mtime);
-            strftime(last_modified_str, sizeof(last_modified_str), "%a, %d %b %Y %H:%M:%S GMT", tm);
-
-            char headers[512];
-            snprintf(headers, sizeof(headers),
-                     "HTTP/1.1 200 OK\r\n"
-                     "Content-Type: text/html; charset=utf-8\r\n"
-                     "Content-Encoding: gzip\r\n"
-                     "ETag: %s\r\n"
-                     "Last-Modified: %s\r\n"
-                     "Content-Length: %zu\r\n"
-                     "\r\n",
-                     etag, last_modified_str, compressed_size);
-            
-            mg_send(c, headers, strlen(headers));
-            mg_send(c, compressed_content, compressed_size);
-            c->is_draining = 1;
-            free(compressed_content);
-            return;
-        }
+    if (cache_result.is_stale) {
+        render_pool_submit(NULL, 0, md_dir_path, render_index);
     }
 
-    char *html_content = generate_index_html();
-    if (!html_content) {
-        mg_http_reply(c, 500, "", "Failed to generate index.");
+    ContentEncoding encoding = http_negotiate_encoding(hm, cache_result_encodings(&cache_result));
+    if (!cache_result_select(&cache_result, encoding)) {
+        release_cache_result(cache_result);
+        http_send_error(c, hm, 500);
         return;
     }
 
-    z_stream strm = {0};
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
-    
-    size_t html_len = strlen(html_content);
-    size_t compressed_capacity = deflateBound(&strm, html_len);
-    char *compressed_content = malloc(compressed_capacity);
-
-    strm.avail_in = html_len;
-    strm.next_in = (Bytef *)html_content;
-    strm.avail_out = compressed_capacity;
-    strm.next_out = (Bytef *)compressed_content;
-
-    deflate(&strm, Z_FINISH);
-    size_t compressed_size = strm.total_out;
-    deflateEnd(&strm);
-    free(html_content);
-
-    FILE *fp = fopen(cache_path, "wb");
-    if (fp) {
-        fwrite(compressed_content, 1, compressed_size, fp);
-        fclose(fp);
+    if (handle_conditional_request(c, hm, cache_result.etag, cache_result.last_modified)) {
+        release_cache_result(cache_result);
+        return;
     }
 
-    char last_modified_str[100];
-    struct tm *tm = gmtime(&latest_mtime);
-    strftime(last_modified_str, sizeof(last_modified_str), "%a, %d %b %Y %H:%M:%S GMT", tm);
-
-    char headers[512];
-    snprintf(headers, sizeof(headers),
-             "HTTP/1.1 200 OK\r\n"
-             "Content-Type: text/html; charset=utf-8\r\n"
-             "Content-Encoding: gzip\r\n"
-             "ETag: %s\r\n"
-             "Last-Modified: %s\r\n"
-             "Content-Length: %zu\r\n"
-             "\r\n",
-             etag, last_modified_str, compressed_size);
-
-    mg_send(c, headers, strlen(headers));
-    mg_send(c, compressed_content, compressed_size);
-    c->is_draining = 1;
-    free(compressed_content);
+    http_send_cache_result(c, "text/html; charset=utf-8", &cache_result);
+    release_cache_result(cache_result);
 }
 
-
-// --- Private helper functions for HTML generation ---
-
-static void append_string(char **buffer, size_t *capacity, const char *str) {
-    size_t current_len = strlen(*buffer);
-    size_t str_len = strlen(str);
-    while (current_len + str_len + 1 > *capacity) {
-        *capacity *= 2;
-        *buffer = realloc(*buffer, *capacity);
+// Render pool job: builds and caches the index page.
+int render_index(const char *md_dir_path) {
+    char template_path[PATH_MAX];
+    CacheDeps deps = index_deps(template_path, sizeof(template_path));
+    time_t latest_mtime;
+    uint64_t version = md_tree_version(&latest_mtime);
+    CacheResult cache_result = get_cached_or_generate_version(
+        md_dir_path, "index", latest_mtime, version, &deps, generate_index_html);
+    if (cache_result.content == NULL) {
+        return 500;
     }
-    strcat(*buffer, str);
+    release_cache_result(cache_result);
+    return 200;
 }
 
-static void list_files_recursive(const char *base_path, const char *rel_path, char **html_buffer, size_t *capacity) {
-    char path[PATH_MAX];
-    snprintf(path, sizeof(path), "%s%s", base_path, rel_path);
-
-    DIR *dir = opendir(path);
-    if (!dir) return;
-
-    struct dirent **namelist;
-    int n = scandir(path, &namelist, NULL, alphasort);
-    if (n < 0) {
-        closedir(dir);
-        return;
-    }
-
-    append_string(html_buffer, capacity, "<ul>");
-
-    for (int i = 0; i < n; i++) {
-        struct dirent *entry = namelist[i];
-        if (entry->d_name[0] == '.') {
-            free(entry);
-            continue;
-        }
+// Describes what the index depends on besides the md/ tree.
+static CacheDeps index_deps(char *template_path, size_t size) {
+    snprintf(template_path, size, "%s/templates/index.html", g_project_root);
+    CacheDeps deps = {
+        .template_path = template_path,
+        .renderer = ((unsigned long) s_index_depth << 16) | INDEX_MARKUP_VERSION,
+    };
+    return deps;
+}
 
-        char full_rel_path[PATH_MAX];
-        snprintf(full_rel_path, sizeof(full_rel_path), "%s%s", rel_path, entry->d_name);
+void index_set_depth(int depth) {
+    s_index_depth = depth > 0 ? depth : 0;
+}
 
-        char entry_full_path[PATH_MAX];
-        snprintf(entry_full_path, sizeof(entry_full_path), "%s/%s", path, entry->d_name);
-        
-        struct stat st;
-        if (stat(entry_full_path, &st) != 0) {
-            free(entry);
-            continue;
-        }
+// --- Private helper functions for HTML generation ---
 
-        if (S_ISDIR(st.st_mode)) {
-            char temp_buffer[PATH_MAX + 64];
-            // Create a unique ID for the details element based on its path
-            snprintf(temp_buffer, sizeof(temp_buffer), "<li><details id=\"details-%s\" open><summary>", full_rel_path);
-            append_string(html_buffer, capacity, temp_buffer);
-            
-            append_string(html_buffer, capacity, entry->d_name);
-            append_string(html_buffer, capacity, "</summary>");
-            
-            char next_rel_path[PATH_MAX];
-            snprintf(next_rel_path, sizeof(next_rel_path), "%s/", full_rel_path);
-            list_files_recursive(base_path, next_rel_path, html_buffer, capacity);
-            
-            append_string(html_buffer, capacity, "</details></li>");
-        } else {
-            const char *ext = strrchr(entry->d_name, '.');
-            if (ext && strcmp(ext, ".md") == 0) {
-                append_string(html_buffer, capacity, "<li><a href=\"/post/");
-                append_string(html_buffer, capacity, full_rel_path);
-                append_string(html_buffer, capacity, "\"> ");
-                append_string(html_buffer, capacity, entry->d_name);
-                append_string(html_buffer, capacity, "</a></li>");
-            }
-        }
-        free(entry);
+// Builds the page without a stitched gzip body, for templates that don't
+// contain the placeholder exactly once.
+static char* generate_index_unstitched(const char *template_content, size_t template_size, size_t *html_size) {
+    StrBuf file_list;
+    str_buf_init(&file_list, 4096);
+    const MdNode *root = md_tree_acquire();
+    if (root) index_fragments_append(&file_list, NULL, root, s_index_depth);
+    md_tree_release();
+
+    size_t list_size;
+    char *list_html = str_buf_detach(&file_list, &list_size);
+    if (list_html == NULL) {
+        return NULL;
     }
-    free(namelist);
-    closedir(dir);
-    append_string(html_buffer, capacity, "</ul>");
-}
 
-static char* generate_index_html() {
-    size_t capacity = 4096;
-    char *html_buffer = malloc(capacity);
-    strcpy(html_buffer, "");
+    StrBuf html;
+    str_buf_init(&html, template_size + list_size);
+    str_buf_append_replaced(&html, template_content, FILE_LIST_PLACEHOLDER, list_html);
+    free(list_html);
+    return str_buf_detach(&html, html_size);
+}
 
-    char md_dir_path[PATH_MAX];
-    snprintf(md_dir_path, sizeof(md_dir_path), "%s/md", g_project_root);
-    list_files_recursive(md_dir_path, "/", &html_buffer, &capacity);
+// (Re)compresses the template halves around the placeholder when the template changed.
+static bool update_template_pieces(const char *template_content, size_t template_size, size_t head_len) {
+    uint64_t hash = hash64(template_content, template_size);
+    if (s_template_pieces.valid && s_template_pieces.template_hash == hash) return true;
+
+    const char *tail = template_content + head_len + strlen(FILE_LIST_PLACEHOLDER);
+    gzip_piece_free(&s_template_pieces.head);
+    gzip_piece_free(&s_template_pieces.tail);
+    s_template_pieces.valid = gzip_piece_compress(template_content, head_len, &s_template_pieces.head) &&
+                              gzip_piece_compress(tail, strlen(tail), &s_template_pieces.tail);
+    s_template_pieces.template_hash = hash;
+    return s_template_pieces.valid;
+}
 
+static char* generate_index_html(const char *md_dir_path, size_t *html_size) {
+    (void)md_dir_path; // The list comes from the in-memory tree
     size_t template_size;
     char template_path[PATH_MAX];
     snprintf(template_path, sizeof(template_path), "%s/templates/index.html", g_project_root);
     char *template_content = read_file_content(template_path, &template_size);
     if (!template_content) {
-        free(html_buffer);
         return NULL;
     }
 
-    char *final_html = str_replace(template_content, "{{FILE_LIST}}", html_buffer);
+    const char *placeholder = strstr(template_content, FILE_LIST_PLACEHOLDER);
+    if (placeholder == NULL || strstr(placeholder + 1, FILE_LIST_PLACEHOLDER) != NULL) {
+        char *page = generate_index_unstitched(template_content, template_size, html_size);
+        free(template_content);
+        return page;
+    }
+    size_t head_len = (size_t) (placeholder - template_content);
+    const char *tail = placeholder + strlen(FILE_LIST_PLACEHOLDER);
+
+    // The page is the template with the file list in place of the placeholder,
+    // and its gzip encoding is stitched together from the precompressed template
+    // halves and directory fragments, so only what changed is compressed again.
+    // The file list comes from the in-memory tree; the filesystem is not walked.
+    pthread_mutex_lock(&s_template_pieces.lock);
+    if (!update_template_pieces(template_content, template_size, head_len)) {
+        pthread_mutex_unlock(&s_template_pieces.lock);
+        free(template_content);
+        return NULL;
+    }
+    StrBuf html;
+    GzipStitch gzip;
+    str_buf_init(&html, s_template_pieces.last_html_size);
+    gzip_stitch_begin(&gzip, s_template_pieces.last_gzip_size);
+    str_buf_append_n(&html, template_content, head_len);
+    gzip_stitch_append(&gzip, &s_template_pieces.head);
+
+    const MdNode *root = md_tree_acquire();
+    if (root) index_fragments_append(&html, &gzip, root, s_index_depth);
+    md_tree_release();
+
+    str_buf_append(&html, tail);
+    gzip_stitch_append(&gzip, &s_template_pieces.tail);
     free(template_content);
-    free(html_buffer);
 
-    return final_html;
-}
\ No newline at end of file
+    size_t gzip_size;
+    char *gzip_data = gzip_stitch_finish(&gzip, &gzip_size);
+    char *page = str_buf_detach(&html, html_size);
+    if (page && gzip_data) {
+        // Remembered so the next build allocates its buffers once
+        s_template_pieces.last_html_size = *html_size;
+        s_template_pieces.last_gzip_size = gzip_size;
+        cache_attach_gzip(gzip_data, gzip_size);
+    } else {
+        free(gzip_data);
+    }
+    pthread_mutex_unlock(&s_template_pieces.lock);
+    return page;
+}
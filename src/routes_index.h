@@ -6,4 +6,12 @@
 // Serves the index page with a list of markdown files
 void serve_index(struct mg_connection *c, struct mg_http_message *hm);
 
+// Builds and caches the index page. Returns an HTTP status (200 once cached).
+// Runs on render threads and during the startup warm-up.
+int render_index(const char *md_dir_path);
+
+// Limits the index to `depth` levels of md/; deeper directories are fetched
+// from /api/tree when opened. 0 (the default) lists the whole tree.
+void index_set_depth(int depth);
+
 #endif // ROUTES_INDEX_H
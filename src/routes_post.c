@@ -1,11 +1,17 @@
 #include "routes_post.h"
 #include "utils.h"
 #include "cache.h"
+#include "negative_cache.h"
+#include "str_buf.h"
 #include "cmark.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
+#include <errno.h>
+
+// cmark options posts are rendered with
+#define POST_CMARK_OPTIONS CMARK_OPT_DEFAULT
 
 // Generator function to convert a Markdown file to an HTML string
 static char* generate_html_from_md(const char *md_path, size_t *html_size) {
@@ -13,7 +19,7 @@ static char* generate_html_from_md(const char *md_path, size_t *html_size) {
     char *md_content = read_file_content(md_path, &md_size);
     if (md_content == NULL) return NULL;
 
-    char *html_body_content = cmark_markdown_to_html(md_content, md_size, 0);
+    char *html_body_content = cmark_markdown_to_html(md_content, md_size, POST_CMARK_OPTIONS);
     free(md_content);
     if (html_body_content == NULL) return NULL;
 
@@ -26,72 +32,92 @@ static char* generate_html_from_md(const char *md_path, size_t *html_size) {
         return NULL;
     }
 
-    char *final_html = str_replace(template_content, "{{POST_CONTENT}}", html_body_content);
+    StrBuf html;
+    str_buf_init(&html, template_size + strlen(html_body_content));
+    str_buf_append_replaced(&html, template_content, "{{POST_CONTENT}}", html_body_content);
     free(template_content);
     free(html_body_content);
-
-    if (final_html) {
-        *html_size = strlen(final_html);
-    }
-    return final_html;
+    return str_buf_detach(&html, html_size);
 }
 
 #include "http_helpers.h"
+#include "render_pool.h"
+
+// Describes what a rendered post depends on besides its Markdown source.
+static CacheDeps post_deps(char *template_path, size_t size) {
+    snprintf(template_path, size, "%s/templates/post.html", g_project_root);
+    CacheDeps deps = {
+        .template_path = template_path,
+        .renderer = ((unsigned long)cmark_version() << 32) | POST_CMARK_OPTIONS,
+    };
+    return deps;
+}
+
+// Render pool job: renders, compresses and caches a post.
+int render_post(const char *md_path) {
+    char template_path[PATH_MAX];
+    CacheDeps deps = post_deps(template_path, sizeof(template_path));
+    CacheResult cache_result = get_cached_or_generate(md_path, &deps, generate_html_from_md);
+    if (cache_result.content == NULL) {
+        // Remember the failure, so repeated requests don't queue the same job again
+        int status = cache_result.error == ENOENT ? 404 : 500;
+        negative_cache_add(md_path, status);
+        return status;
+    }
+    release_cache_result(cache_result);
+    return 200;
+}
 
 // Serves a markdown file, using a cache to provide a compressed response
 void serve_post(struct mg_connection *c, struct mg_http_message *hm) {
     char md_path[PATH_MAX];
-    const char *relative_md_path = hm->uri.buf + strlen("/post/");
-    snprintf(md_path, sizeof(md_path), "%s/md/%s", g_project_root, relative_md_path);
-    for (char *p = md_path; *p; p++) {
-        if (*p == ' ') { *p = '\0'; break; } // Corrected escaping for null terminator
-    }
+    // The URI is not NUL-terminated; pipelined requests may follow it in the buffer
+    struct mg_str relative_md_path = mg_str_n(hm->uri.buf + strlen("/post/"), hm->uri.len - strlen("/post/"));
+    snprintf(md_path, sizeof(md_path), "%s/md/%.*s", g_project_root,
+             (int) relative_md_path.len, relative_md_path.buf);
 
     if (strstr(md_path, "..") != NULL) {
-        mg_http_reply(c, 400, "Content-Type: text/plain; charset=utf-8\r\n", "Bad Request\n");
+        http_send_error(c, hm, 400);
         return;
     }
 
-    CacheResult cache_result = get_cached_or_generate(md_path, generate_html_from_md);
+    char template_path[PATH_MAX];
+    CacheDeps deps = post_deps(template_path, sizeof(template_path));
+    CacheResult cache_result = get_cached(md_path, &deps);
 
     if (cache_result.content == NULL) {
-        free_cache_result(cache_result);
-        if (access(md_path, F_OK) != 0) {
-            mg_http_reply(c, 404, "Content-Type: text/plain; charset=utf-8\r\n", "File Not Found\n");
+        // Not in memory: render off the event loop, so cache hits never wait behind it.
+        // A replayed request that still misses was evicted in between; queue it again.
+        // Sources that recently turned out missing or broken are answered right away.
+        int status = http_render_status(c);
+        if (status == 0) status = negative_cache_lookup(md_path);
+        if (status == 0 || status == 200) {
+            http_defer_to_render_pool(c, hm, md_path, render_post);
         } else {
-            mg_http_reply(c, 500, "Content-Type: text/plain; charset=utf-8\r\n", "Internal Server Error\n");
+            http_send_error(c, hm, status == 404 ? 404 : 500);
         }
         return;
     }
 
+    if (cache_result.is_stale) {
+        // Serve the previous version while the new one renders in the background
+        render_pool_submit(NULL, 0, md_path, render_post);
+    }
+
+    ContentEncoding encoding = http_negotiate_encoding(hm, cache_result_encodings(&cache_result));
+    if (!cache_result_select(&cache_result, encoding)) {
+        release_cache_result(cache_result);
+        http_send_error(c, hm, 500);
+        return;
+    }
+
     // Use the new helper to handle conditional requests
     if (handle_conditional_request(c, hm, cache_result.etag, cache_result.last_modified)) {
-        free_cache_result(cache_result);
+        release_cache_result(cache_result);
         return; // Response (304) was already sent by the helper
     }
 
-    // Format timestamp for Last-Modified header
-    char last_modified_str[100];
-    struct tm *tm = gmtime(&cache_result.last_modified);
-    strftime(last_modified_str, sizeof(last_modified_str), "%a, %d %b %Y %H:%M:%S GMT", tm);
-
     // Serve the content with all headers
-    char headers[512];
-    snprintf(headers, sizeof(headers),
-             "HTTP/1.1 200 OK\r\n"
-             "Content-Type: text/html; charset=utf-8\r\n"
-             "Content-Encoding: gzip\r\n"
-             "ETag: %s\r\n"
-             "Last-Modified: %s\r\n"
-             "Content-Length: %zu\r\n"
-             "\r\n",
-             cache_result.etag,
-             last_modified_str,
-             cache_result.size);
-
-    mg_send(c, headers, strlen(headers));
-    mg_send(c, cache_result.content, cache_result.size);
-
-    c->is_draining = 1;
-    free_cache_result(cache_result);
+    http_send_cache_result(c, "text/html; charset=utf-8", &cache_result);
+    release_cache_result(cache_result);
 }
@@ -6,4 +6,8 @@
 // Serves a single post page
 void serve_post(struct mg_connection *c, struct mg_http_message *hm);
 
+// Renders, compresses and caches a post. Returns an HTTP status (200 once cached).
+// Runs on render threads and during the startup warm-up.
+int render_post(const char *md_path);
+
 #endif // ROUTES_POST_H
@@ -0,0 +1,199 @@
+#include "routes_tree.h"
+#include "utils.h"
+#include "http_helpers.h"
+#include "cache.h"
+#include "md_tree.h"
+#include "render_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Bump whenever generate_tree() produces different output, so that cached
+// fragments are rebuilt.
+#define TREE_MARKUP_VERSION 1
+// Cache keys are one of these prefixes followed by the directory path, e.g.
+// "tree.html:/sub", which also lets the startup scan drop levels of removed directories
+#define HTML_KEY_PREFIX "tree.html:"
+#define JSON_KEY_PREFIX "tree.json:"
+
+// Fragments depend on nothing but the md/ tree
+static const CacheDeps s_tree_deps = { .renderer = TREE_MARKUP_VERSION };
+
+// Forward declarations
+static bool build_cache_key(struct mg_http_message *hm, char *key, size_t size);
+static const char *key_path(const char *key, bool *json);
+static uint64_t directory_version(const char *path, time_t *mtime);
+static char *generate_tree(const char *key, size_t *size);
+
+// Serves one directory level. Only the requested directory is rendered, so the
+// index page can list the top level and fetch the rest when it is opened.
+void serve_tree(struct mg_connection *c, struct mg_http_message *hm) {
+    char key[PATH_MAX + 16];
+    if (!build_cache_key(hm, key, sizeof(key))) {
+        http_send_error(c, hm, 400);
+        return;
+    }
+    bool json;
+    const char *path = key_path(key, &json);
+    // Checked against the in-memory tree, so unknown paths never reach the render pool
+    time_t mtime;
+    uint64_t version = directory_version(path, &mtime);
+    if (version == 0) {
+        http_send_error(c, hm, 404);
+        return;
+    }
+
+    CacheResult cache_result = get_cached_version(key, mtime, version, &s_tree_deps);
+    if (cache_result.content == NULL) {
+        int status = http_render_status(c);
+        if (status == 0 || status == 200) {
+            http_defer_to_render_pool(c, hm, key, render_tree);
+        } else {
+            http_send_error(c, hm, status == 404 ? 404 : 500);
+        }
+        return;
+    }
+
+    if (cache_result.is_stale) {
+        render_pool_submit(NULL, 0, key, render_tree);
+    }
+
+    ContentEncoding encoding = http_negotiate_encoding(hm, cache_result_encodings(&cache_result));
+    if (!cache_result_select(&cache_result, encoding)) {
+        release_cache_result(cache_result);
+        http_send_error(c, hm, 500);
+        return;
+    }
+
+    if (handle_conditional_request(c, hm, cache_result.etag, cache_result.last_modified)) {
+        release_cache_result(cache_result);
+        return;
+    }
+
+    http_send_cache_result(c, json ? "application/json" : "text/html; charset=utf-8", &cache_result);
+    release_cache_result(cache_result);
+}
+
+// Render pool job: builds and caches one directory level.
+int render_tree(const char *key) {
+    bool json;
+    time_t mtime;
+    uint64_t version = directory_version(key_path(key, &json), &mtime);
+    if (version == 0) {
+        return 404;
+    }
+    CacheResult cache_result = get_cached_or_generate_version(key, key, mtime, version, &s_tree_deps, generate_tree);
+    if (cache_result.content == NULL) {
+        return 500;
+    }
+    release_cache_result(cache_result);
+    return 200;
+}
+
+void tree_append_lazy_dir(StrBuf *html, const char *path, const char *name) {
+    str_buf_append(html, "<li><details id=\"details-");
+    str_buf_append_html(html, path);
+    str_buf_append(html, "\" data-path=\"");
+    str_buf_append_html(html, path);
+    str_buf_append(html, "\"><summary>");
+    str_buf_append_html(html, name);
+    str_buf_append(html, "</summary></details></li>");
+}
+
+// --- Private helpers ---
+
+// Builds the cache key for the request from its "path" and "format" parameters.
+// The path is normalized ("sub//dir/" becomes "/sub/dir"), so that all spellings
+// share one cache entry. Returns false for a malformed request.
+static bool build_cache_key(struct mg_http_message *hm, char *key, size_t size) {
+    char path[PATH_MAX], format[16];
+    int len = mg_http_get_var(&hm->query, "path", path, sizeof(path));
+    if (len == -3) return false;  // Undecodable or too long
+    if (len < 0) path[0] = '\0';
+    len = mg_http_get_var(&hm->query, "format", format, sizeof(format));
+    if (len < 0) strcpy(format, "html");
+    if (strcmp(format, "html") != 0 && strcmp(format, "json") != 0) return false;
+
+    int n = snprintf(key, size, "%s", strcmp(format, "json") == 0 ? JSON_KEY_PREFIX : HTML_KEY_PREFIX);
+    size_t key_len = (size_t) n;
+    char *save;
+    for (char *p = strtok_r(path, "/", &save); p != NULL; p = strtok_r(NULL, "/", &save)) {
+        n = snprintf(key + key_len, size - key_len, "/%s", p);
+        if (n < 0 || (size_t) n >= size - key_len) return false;
+        key_len += (size_t) n;
+    }
+    if (key[key_len - 1] == ':') snprintf(key + key_len, size - key_len, "/");
+    return true;
+}
+
+// Returns the directory path within a cache key and whether the key is for JSON.
+static const char *key_path(const char *key, bool *json) {
+    *json = strncmp(key, JSON_KEY_PREFIX, strlen(JSON_KEY_PREFIX)) == 0;
+    return key + strlen(*json ? JSON_KEY_PREFIX : HTML_KEY_PREFIX);
+}
+
+// Returns the entries_version of a directory, or 0 if it is not a directory in
+// the tree, and sets `mtime` to the latest mtime of it and its entries. Changes
+// deeper down don't affect a level's listing.
+static uint64_t directory_version(const char *path, time_t *mtime) {
+    const MdNode *node = md_tree_find(md_tree_acquire(), path);
+    uint64_t version = node && node->is_dir ? node->entries_version : 0;
+    *mtime = node && node->is_dir ? node->contents_mtime : 0;
+    md_tree_release();
+    return version;
+}
+
+// Cache generator: lists one directory level from the in-memory tree.
+static char *generate_tree(const char *key, size_t *size) {
+    bool json;
+    const char *path = key_path(key, &json);
+    const char *sep = strcmp(path, "/") == 0 ? "" : "/";  // Avoids "//name" below the root
+
+    StrBuf out;
+    str_buf_init(&out, 0);
+    const MdNode *dir = md_tree_find(md_tree_acquire(), path);
+    if (dir == NULL || !dir->is_dir) {
+        md_tree_release();
+        str_buf_free(&out);
+        return NULL;
+    }
+
+    if (json) {
+        str_buf_append(&out, "{\"path\":");
+        str_buf_append_json(&out, path);
+        str_buf_append(&out, ",\"entries\":[");
+    } else {
+        str_buf_append(&out, "<ul>");
+    }
+    bool first = true;
+    for (size_t i = 0; i < dir->child_count; i++) {
+        const MdNode *entry = dir->children[i];
+        char child_path[PATH_MAX];
+        int n = snprintf(child_path, sizeof(child_path), "%s%s%s", path, sep, entry->name);
+        if (n < 0 || (size_t) n >= sizeof(child_path)) continue;
+
+        if (json) {
+            str_buf_append(&out, first ? "{\"name\":" : ",{\"name\":");
+            str_buf_append_json(&out, entry->name);
+            if (entry->is_dir) {
+                str_buf_append(&out, ",\"type\":\"dir\"}");
+            } else {
+                str_buf_appendf(&out, ",\"type\":\"file\",\"size\":%lld,\"mtime\":%lld}",
+                                (long long) entry->size, (long long) entry->mtime);
+            }
+        } else if (entry->is_dir) {
+            tree_append_lazy_dir(&out, child_path, entry->name);
+        } else {
+            // Same link as on the full index, so both share the post's cache entry
+            str_buf_append(&out, "<li><a href=\"/post/");
+            str_buf_append_html(&out, child_path);
+            str_buf_append(&out, "\"> ");
+            str_buf_append_html(&out, entry->name);
+            str_buf_append(&out, "</a></li>");
+        }
+        first = false;
+    }
+    md_tree_release();
+    str_buf_append(&out, json ? "]}" : "</ul>");
+    return str_buf_detach(&out, size);
+}
@@ -0,0 +1,19 @@
+#ifndef ROUTES_TREE_H
+#define ROUTES_TREE_H
+
+#include "mongoose.h"
+#include "str_buf.h"
+
+// Serves /api/tree?path=/dir[&format=json]: one directory level of md/, as an
+// HTML fragment for the index page (default) or as JSON
+void serve_tree(struct mg_connection *c, struct mg_http_message *hm);
+
+// Builds and caches one directory level; `key` is the cache key built by
+// serve_tree(). Returns an HTTP status (200 once cached). Runs on render threads.
+int render_tree(const char *key);
+
+// Appends the index list item of a directory whose contents are fetched from
+// /api/tree when it is first opened. `path` is relative to md/, e.g. "/sub".
+void tree_append_lazy_dir(StrBuf *html, const char *path, const char *name);
+
+#endif // ROUTES_TREE_H
@@ -1,34 +1,174 @@
 #include "mongoose.h"
 #include "routes.h" // Include our routes header
 #include "utils.h"  // Include our new utils header
+#include "watcher.h"
+#include "http_helpers.h"
+#include "render_pool.h"
+#include "cache.h"
+#include "warmup.h"
+#include "md_tree.h"
 #include <stdio.h>
 #include <string.h> // Required for strncmp
+#include <stdlib.h>
 #include <unistd.h> // For readlink
+#include <fcntl.h>
+#include <pthread.h>
+
+#define LISTEN_URL "http://localhost:8000"
+#define MAX_WORKERS 64
+// Cache misses that may wait for a render thread before we answer 503
+#define RENDER_QUEUE_CAPACITY 1024
+// Default size budget of the cache/ directory, in megabytes
+#define DEFAULT_DISK_CACHE_MB 1024
+
+// Dispatches a request to its route handler
+static void route_request(struct mg_connection *c, struct mg_http_message *hm) {
+  // Construct the full path for the static directory
+  char static_dir_path[PATH_MAX];
+  snprintf(static_dir_path, sizeof(static_dir_path), "%s/static", g_project_root);
+  struct mg_http_serve_opts opts = {.root_dir = static_dir_path};
+
+  // Route the request based on the URL
+  if (mg_strcmp(hm->uri, mg_str("/")) == 0) {
+    serve_index(c, hm); // Handle the index page
+  } else if (strncmp(hm->uri.buf, "/post/", 6) == 0) {
+    serve_post(c, hm); // Handle post pages
+  } else if (mg_strcmp(hm->uri, mg_str("/api/tree")) == 0) {
+    serve_tree(c, hm); // One directory level, for expanding the index lazily
+  } else if (mg_strcmp(hm->uri, mg_str("/ready")) == 0) {
+    // For load balancers: unavailable until the startup warm-up has filled the cache
+    if (warmup_is_ready()) {
+      http_reply(c, 200, "Content-Type: text/plain\r\nCache-Control: no-store\r\n", "ready\n");
+    } else {
+      http_reply(c, 503, "Content-Type: text/plain\r\nCache-Control: no-store\r\nRetry-After: 1\r\n",
+                 "warming up\n");
+    }
+  } else if (strncmp(hm->uri.buf, "/static/", 8) == 0) {
+    opts.extra_headers = http_connection_header(c);
+    mg_http_serve_dir(c, hm, &opts); // Serve files from the 'static' directory
+  } else {
+    http_send_error(c, hm, 404);
+  }
+}
 
 // The main event handler function
 static void fn(struct mg_connection *c, int ev, void *ev_data) {
   if (ev == MG_EV_HTTP_MSG) {
     struct mg_http_message *hm = (struct mg_http_message *) ev_data;
-    
-    // Construct the full path for the static directory
-    char static_dir_path[PATH_MAX];
-    snprintf(static_dir_path, sizeof(static_dir_path), "%s/static", g_project_root);
-    struct mg_http_serve_opts opts = {.root_dir = static_dir_path};
-
-    // Route the request based on the URL
-    if (mg_strcmp(hm->uri, mg_str("/")) == 0) {
-      serve_index(c, hm); // Handle the index page
-    } else if (strncmp(hm->uri.buf, "/post/", 6) == 0) {
-      serve_post(c, hm); // Handle post pages
-    } else if (strncmp(hm->uri.buf, "/static/", 8) == 0) {
-      mg_http_serve_dir(c, hm, &opts); // Serve files from the 'static' directory
-    } else {
-      mg_http_reply(c, 404, "Content-Type: text/plain\r\n", "Not Found\n");
+    http_begin_request(c, hm);
+    route_request(c, hm);
+  } else if (ev == MG_EV_WAKEUP) {
+    // A render job finished: replay the request that was waiting for it
+    struct mg_http_message hm;
+    char *request = http_resume_request(c, (struct mg_str *) ev_data, &hm);
+    if (request != NULL) {
+      route_request(c, &hm);
+      http_end_replay(c, request);
     }
+  } else if (ev == MG_EV_POLL) {
+    // A render job that never reported back: look once more, or give up with 503
+    struct mg_http_message hm;
+    char *request = http_resume_expired_request(c, &hm);
+    if (request != NULL) {
+      route_request(c, &hm);
+      http_end_replay(c, request);
+    }
+  }
+  http_handle_connection_event(c, ev);
+}
+
+// Opens a listening socket with SO_REUSEPORT, so that every worker can bind the
+// same port and the kernel spreads incoming connections across them.
+static int open_reuseport_socket(const char *url) {
+  struct mg_addr addr;
+  memset(&addr, 0, sizeof(addr));
+  if (!mg_aton(mg_url_host(url), &addr) || addr.is_ip6) return -1;
+
+  struct sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = mg_htons(mg_url_port(url));
+  memcpy(&sin.sin_addr, addr.ip, sizeof(sin.sin_addr));
+
+  int on = 1;
+  int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (fd < 0) return -1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0 ||
+      bind(fd, (struct sockaddr *) &sin, sizeof(sin)) != 0 ||
+      listen(fd, MG_SOCK_LISTEN_BACKLOG_SIZE) != 0) {
+    perror("reuseport listener");
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  return fd;
+}
+
+// Creates an HTTP listener on `url` whose socket is shared with the other workers.
+// Mongoose has no hook to set socket options before bind(), so we let it create
+// a listener on an ephemeral port and swap in our own SO_REUSEPORT socket.
+static struct mg_connection *listen_reuseport(struct mg_mgr *mgr, const char *url) {
+  int fd = open_reuseport_socket(url);
+  if (fd < 0) return NULL;
+  struct mg_connection *c = mg_http_listen(mgr, "http://127.0.0.1:0", fn, NULL);
+  if (c == NULL) {
+    close(fd);
+    return NULL;
   }
+  close((int) (size_t) c->fd);  // Also drops it from mgr's epoll set
+  c->fd = (void *) (size_t) fd;
+  MG_EPOLL_ADD(c);
+  c->loc.port = mg_htons(mg_url_port(url));
+  return c;
+}
+
+// Runs one event loop. Each worker owns its mg_mgr; only the caches are shared.
+static void *worker_main(void *arg) {
+  struct mg_mgr *mgr = (struct mg_mgr *) arg;
+  for (;;) mg_mgr_poll(mgr, 1000);
+  return NULL;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [--workers N] [--render-threads N] [--stale-while-revalidate SECONDS]"
+                  " [--cache-size MB] [--index-depth N] [--warm-up | --warm-up-sync] [--warm-up-threads N]\n", prog);
 }
 
-int main(void) {
+int main(int argc, char *argv[]) {
+  int workers = 1;
+  int render_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  long cache_size_mb = DEFAULT_DISK_CACHE_MB;
+  bool warm_up = false, warm_up_sync = false;
+  int warm_up_threads = 0;  // 0 = as many as render threads
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+      workers = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--render-threads") == 0 && i + 1 < argc) {
+      render_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--stale-while-revalidate") == 0 && i + 1 < argc) {
+      cache_set_stale_window(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+      cache_size_mb = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--index-depth") == 0 && i + 1 < argc) {
+      index_set_depth(atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--warm-up") == 0) {
+      warm_up = true;
+    } else if (strcmp(argv[i], "--warm-up-sync") == 0) {
+      warm_up = warm_up_sync = true;
+    } else if (strcmp(argv[i], "--warm-up-threads") == 0 && i + 1 < argc) {
+      warm_up_threads = atoi(argv[++i]);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (workers < 1 || workers > MAX_WORKERS) {
+    fprintf(stderr, "--workers must be between 1 and %d\n", MAX_WORKERS);
+    return 1;
+  }
+  if (render_threads < 1) render_threads = 1;
+
   // Get the project root directory when the server starts
   get_project_root(g_project_root, sizeof(g_project_root));
   
@@ -40,11 +180,59 @@ int main(void) {
   }
   printf("Project root: %s\n", g_project_root);
 
-  struct mg_mgr mgr;
-  mg_mgr_init(&mgr);
-  printf("Starting server on http://localhost:8000\n");
-  mg_http_listen(&mgr, "http://localhost:8000", fn, NULL);
-  for (;;) mg_mgr_poll(&mgr, 1000);
-  mg_mgr_free(&mgr);
+  char md_dir_path[PATH_MAX];
+  snprintf(md_dir_path, sizeof(md_dir_path), "%s/md", g_project_root);
+
+  // Drop cache files of deleted posts and keep cache/ within its budget
+  cache_init_disk(cache_size_mb > 0 ? (size_t) cache_size_mb * 1024 * 1024 : 0);
+
+  // Watch md/ and templates/ so that cache freshness checks don't need to stat the filesystem
+  char templates_dir_path[PATH_MAX];
+  snprintf(templates_dir_path, sizeof(templates_dir_path), "%s/templates", g_project_root);
+  const char *watched_paths[] = { md_dir_path, templates_dir_path };
+  if (!watcher_start(watched_paths, 2)) {
+    printf("File watcher unavailable, falling back to mtime checks\n");
+  }
+  // Model of md/ for the index, kept current by the watcher
+  md_tree_init(md_dir_path);
+
+  // Cache misses are rendered off the event loops
+  if (!render_pool_start(render_threads, RENDER_QUEUE_CAPACITY)) {
+    fprintf(stderr, "Cannot start render threads\n");
+    return 1;
+  }
+
+  // Render every page before (or while) taking traffic; /ready reports the end
+  if (warm_up) {
+    warmup_start(warm_up_threads > 0 ? warm_up_threads : render_threads, warm_up_sync);
+  }
+
+  printf("Starting server on %s with %d worker(s), %d render thread(s)\n",
+         LISTEN_URL, workers, render_threads);
+  if (workers == 1) {
+    struct mg_mgr mgr;
+    mg_mgr_init(&mgr);
+    mg_wakeup_init(&mgr);
+    mg_http_listen(&mgr, LISTEN_URL, fn, NULL);
+    worker_main(&mgr);
+    mg_mgr_free(&mgr);
+    return 0;
+  }
+
+  struct mg_mgr mgrs[MAX_WORKERS];
+  pthread_t threads[MAX_WORKERS];
+  for (int i = 0; i < workers; i++) {
+    mg_mgr_init(&mgrs[i]);
+    mg_wakeup_init(&mgrs[i]);
+    if (listen_reuseport(&mgrs[i], LISTEN_URL) == NULL) {
+      fprintf(stderr, "Cannot listen on %s\n", LISTEN_URL);
+      return 1;
+    }
+  }
+  // The main thread runs the first worker itself
+  for (int i = 1; i < workers; i++) {
+    pthread_create(&threads[i], NULL, worker_main, &mgrs[i]);
+  }
+  worker_main(&mgrs[0]);
   return 0;
-}
\ No newline at end of file
+}
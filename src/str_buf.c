@@ -0,0 +1,137 @@
+#include "str_buf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+#define DEFAULT_CAPACITY 256
+
+// Forward declarations
+static bool reserve(StrBuf *buf, size_t extra);
+
+void str_buf_init(StrBuf *buf, size_t capacity) {
+    memset(buf, 0, sizeof(*buf));
+    reserve(buf, capacity ? capacity : DEFAULT_CAPACITY);
+}
+
+void str_buf_append_n(StrBuf *buf, const char *data, size_t len) {
+    if (!reserve(buf, len)) return;
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+void str_buf_append(StrBuf *buf, const char *str) {
+    str_buf_append_n(buf, str, strlen(str));
+}
+
+void str_buf_appendf(StrBuf *buf, const char *fmt, ...) {
+    if (buf->failed) return;
+    va_list ap;
+    va_start(ap, fmt);
+    va_list retry;
+    va_copy(retry, ap);
+    // Usually the text fits into the spare capacity and is formatted only once
+    size_t room = buf->capacity - buf->len;
+    int n = vsnprintf(buf->data + buf->len, room, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        buf->failed = true;
+    } else if ((size_t) n < room) {
+        buf->len += (size_t) n;
+    } else if (reserve(buf, (size_t) n)) {
+        vsnprintf(buf->data + buf->len, buf->capacity - buf->len, fmt, retry);
+        buf->len += (size_t) n;
+    }
+    va_end(retry);
+}
+
+void str_buf_append_html(StrBuf *buf, const char *str) {
+    const char *run = str;
+    for (const char *p = str; *p; p++) {
+        const char *entity;
+        switch (*p) {
+            case '&': entity = "&amp;"; break;
+            case '<': entity = "&lt;"; break;
+            case '>': entity = "&gt;"; break;
+            case '"': entity = "&quot;"; break;
+            case '\'': entity = "&#39;"; break;
+            default: continue;
+        }
+        str_buf_append_n(buf, run, (size_t) (p - run));
+        str_buf_append(buf, entity);
+        run = p + 1;
+    }
+    str_buf_append(buf, run);
+}
+
+void str_buf_append_json(StrBuf *buf, const char *str) {
+    str_buf_append_n(buf, "\"", 1);
+    const char *run = str;
+    for (const char *p = str; *p; p++) {
+        unsigned char ch = (unsigned char) *p;
+        if (ch >= 0x20 && ch != '"' && ch != '\\') continue;
+        str_buf_append_n(buf, run, (size_t) (p - run));
+        if (ch == '"' || ch == '\\') {
+            str_buf_appendf(buf, "\\%c", ch);
+        } else {
+            str_buf_appendf(buf, "\\u%04x", ch);
+        }
+        run = p + 1;
+    }
+    str_buf_append(buf, run);
+    str_buf_append_n(buf, "\"", 1);
+}
+
+void str_buf_append_replaced(StrBuf *buf, const char *text, const char *placeholder, const char *value) {
+    size_t placeholder_len = strlen(placeholder);
+    size_t value_len = strlen(value);
+    const char *match;
+    while (placeholder_len > 0 && (match = strstr(text, placeholder)) != NULL) {
+        str_buf_append_n(buf, text, (size_t) (match - text));
+        str_buf_append_n(buf, value, value_len);
+        text = match + placeholder_len;
+    }
+    str_buf_append(buf, text);
+}
+
+char *str_buf_detach(StrBuf *buf, size_t *len) {
+    char *data = buf->failed ? NULL : buf->data;
+    if (data == NULL) free(buf->data);
+    if (len) *len = data ? buf->len : 0;
+    memset(buf, 0, sizeof(*buf));
+    return data;
+}
+
+void str_buf_free(StrBuf *buf) {
+    free(buf->data);
+    memset(buf, 0, sizeof(*buf));
+}
+
+// --- Private helpers ---
+
+// Makes room for `extra` more bytes plus the terminating NUL, doubling the
+// capacity as needed. Returns false if the buffer failed.
+static bool reserve(StrBuf *buf, size_t extra) {
+    if (buf->failed) return false;
+    if (buf->len + extra < buf->capacity) return true;
+
+    size_t capacity = buf->capacity ? buf->capacity : DEFAULT_CAPACITY;
+    while (buf->len + extra >= capacity) {
+        if (capacity > SIZE_MAX / 2) {
+            buf->failed = true;
+            return false;
+        }
+        capacity *= 2;
+    }
+    char *data = realloc(buf->data, capacity);
+    if (data == NULL) {
+        buf->failed = true;
+        return false;
+    }
+    if (buf->capacity == 0) data[0] = '\0';
+    buf->data = data;
+    buf->capacity = capacity;
+    return true;
+}
@@ -0,0 +1,75 @@
+#ifndef STR_BUF_H
+#define STR_BUF_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * @brief A growable output buffer for building pages.
+ *
+ * Tracks its length, so appends never rescan what was already written, and
+ * grows geometrically, so building n bytes takes O(n) time. The contents are
+ * always NUL-terminated. If an allocation fails, the buffer is marked as
+ * failed and further appends are ignored; str_buf_detach() then returns NULL,
+ * so callers only need to check once at the end.
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+    bool failed;
+} StrBuf;
+
+/**
+ * @brief Initializes an empty buffer with room for `capacity` bytes (0 for a default).
+ */
+void str_buf_init(StrBuf *buf, size_t capacity);
+
+/**
+ * @brief Appends `len` bytes of `data`.
+ */
+void str_buf_append_n(StrBuf *buf, const char *data, size_t len);
+
+/**
+ * @brief Appends a NUL-terminated string.
+ */
+void str_buf_append(StrBuf *buf, const char *str);
+
+/**
+ * @brief Appends printf-style formatted text.
+ */
+void str_buf_appendf(StrBuf *buf, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief Appends a string with the characters special in HTML text and
+ * attribute values (&, <, >, " and ') replaced by entities.
+ */
+void str_buf_append_html(StrBuf *buf, const char *str);
+
+/**
+ * @brief Appends a string as a quoted JSON string literal.
+ */
+void str_buf_append_json(StrBuf *buf, const char *str);
+
+/**
+ * @brief Appends `text` with every occurrence of `placeholder` replaced by `value`.
+ *
+ * Used to fill page templates. Neither `text` nor `value` is copied anywhere else.
+ */
+void str_buf_append_replaced(StrBuf *buf, const char *text, const char *placeholder, const char *value);
+
+/**
+ * @brief Hands the contents over to the caller, without copying, and resets the buffer.
+ *
+ * @param len Receives the length of the contents (may be NULL).
+ * @return The NUL-terminated contents, to be released with free(), or NULL if
+ *         an allocation failed along the way.
+ */
+char *str_buf_detach(StrBuf *buf, size_t *len);
+
+/**
+ * @brief Releases the contents of a buffer that is not detached.
+ */
+void str_buf_free(StrBuf *buf);
+
+#endif // STR_BUF_H
@@ -49,85 +49,97 @@ char* read_file_content(const char *path, size_t *size) {
     return buffer;
 }
 
-#include <sys/stat.h>
-#include <dirent.h>
-
-// Helper function to replace a substring in a string
-char* str_replace(const char *orig, const char *rep, const char *with) {
-    char *result; 
-    char *ins;
-    char *tmp;
-    int len_rep;
-    int len_with;
-    int len_front;
-    int count;
+// FNV-1a hash of a NUL-terminated string, used for in-memory hash tables.
+unsigned long hash_string(const char *str) {
+    unsigned long h = 2166136261UL;
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        h ^= *p;
+        h *= 16777619UL;
+    }
+    return h;
+}
 
-    if (!orig || !rep) return NULL;
-    len_rep = strlen(rep);
-    if (len_rep == 0) return NULL;
-    if (!with) with = "";
-    len_with = strlen(with);
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
 
-    ins = (char *) orig;
-    for (count = 0; (tmp = strstr(ins, rep)); ++count) {
-        ins = tmp + len_rep;
-    }
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
 
-    tmp = result = (char *) malloc(strlen(orig) + (len_with - len_rep) * count + 1);
+// Unaligned little-endian reads, as XXH64 specifies. Hashes end up in ETags,
+// which must be the same on every server whatever its byte order; compilers
+// turn these into single loads on little-endian hosts.
+static uint64_t read64(const unsigned char *p) {
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+           (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
 
-    if (!result) return NULL;
+static uint32_t read32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
 
-    while (count--) {
-        ins = strstr(orig, rep);
-        len_front = ins - orig;
-        tmp = strncpy(tmp, orig, len_front) + len_front;
-        tmp = strcpy(tmp, with) + len_with;
-        orig += len_front + len_rep;
-    }
-    strcpy(tmp, orig);
-    return result;
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
 }
 
-// Recursively finds the most recent modification time of any file or directory
-// within the given base_path.
-time_t get_latest_mtime_in_dir(const char *base_path) {
-    time_t latest_mtime = 0;
-    DIR *dir;
-    struct dirent *entry;
-    struct stat st;
-    char path[PATH_MAX];
+static uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
 
-    if (!(dir = opendir(base_path))) {
-        return 0; // Return 0 if directory cannot be opened
+// XXH64 with seed 0: fast enough to run over whole pages, unlike FNV-1a. The
+// result is the same on every host.
+uint64_t hash64(const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        const unsigned char *limit = end - 32;
+        uint64_t v1 = XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = XXH_PRIME64_2;
+        uint64_t v3 = 0;
+        uint64_t v4 = -XXH_PRIME64_1;
+        do {
+            v1 = xxh64_round(v1, read64(p));
+            v2 = xxh64_round(v2, read64(p + 8));
+            v3 = xxh64_round(v3, read64(p + 16));
+            v4 = xxh64_round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    } else {
+        h = XXH_PRIME64_5;
     }
+    h += (uint64_t)len;
 
-    // Get mtime of the directory itself
-    if (stat(base_path, &st) == 0) {
-        latest_mtime = st.st_mtime;
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh64_round(0, read64(p));
+        h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
     }
-
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-
-        snprintf(path, sizeof(path), "%s/%s", base_path, entry->d_name);
-        if (stat(path, &st) != 0) {
-            continue;
-        }
-
-        if (st.st_mtime > latest_mtime) {
-            latest_mtime = st.st_mtime;
-        }
-
-        if (S_ISDIR(st.st_mode)) {
-            time_t subdir_mtime = get_latest_mtime_in_dir(path);
-            if (subdir_mtime > latest_mtime) {
-                latest_mtime = subdir_mtime;
-            }
-        }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * XXH_PRIME64_1;
+        h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (uint64_t)*p * XXH_PRIME64_5;
+        h = rotl64(h, 11) * XXH_PRIME64_1;
     }
-    closedir(dir);
-    return latest_mtime;
-}
 
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
@@ -2,6 +2,7 @@
 #define UTILS_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <limits.h> // For PATH_MAX
 #include <time.h>   // For time_t
 
@@ -13,8 +14,8 @@ extern char g_project_root[PATH_MAX];
 void get_project_root(char *out, size_t size);
 
 char* read_file_content(const char *path, size_t *size);
-char* str_replace(const char *orig, const char *rep, const char *with);
-time_t get_latest_mtime_in_dir(const char *base_path);
+unsigned long hash_string(const char *str);
+uint64_t hash64(const void *data, size_t len);
 
 
 #endif // UTILS_H
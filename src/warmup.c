@@ -0,0 +1,115 @@
+#include "warmup.h"
+#include "routes.h"
+#include "utils.h"
+#include "md_tree.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// Upper bound on warm-up threads, whatever the command line says
+#define MAX_WARMUP_THREADS 64
+
+static struct {
+    char **paths;               // Absolute paths of the posts to render
+    size_t count, capacity;
+    atomic_size_t next;         // Index of the next path to take
+    atomic_size_t failed;
+    int threads;
+    atomic_bool ready;
+} s_warmup = { .ready = true };
+
+// Forward declarations
+static void collect_posts(const MdNode *dir, const char *dir_path);
+static void *warmup_main(void *arg);
+static void *warmup_thread(void *arg);
+
+void warmup_start(int threads, bool wait) {
+    if (threads < 1) threads = 1;
+    if (threads > MAX_WARMUP_THREADS) threads = MAX_WARMUP_THREADS;
+    s_warmup.threads = threads;
+    atomic_store(&s_warmup.ready, false);
+
+    pthread_t thread;
+    if (wait || pthread_create(&thread, NULL, warmup_main, NULL) != 0) {
+        warmup_main(NULL);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+bool warmup_is_ready(void) {
+    return atomic_load(&s_warmup.ready);
+}
+
+// --- Private helpers ---
+
+static void *warmup_main(void *arg) {
+    (void)arg;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    char md_dir_path[PATH_MAX];
+    snprintf(md_dir_path, sizeof(md_dir_path), "%s/md", g_project_root);
+    // Take the posts from the same model the index is built from, so the
+    // warm-up renders exactly what the index links to
+    const MdNode *root = md_tree_acquire();
+    if (root) collect_posts(root, md_dir_path);
+    md_tree_release();
+
+    pthread_t threads[MAX_WARMUP_THREADS];
+    int started = 0;
+    while (started < s_warmup.threads && (size_t)started < s_warmup.count &&
+           pthread_create(&threads[started], NULL, warmup_thread, NULL) == 0) {
+        started++;
+    }
+    if (started == 0) warmup_thread(NULL);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+    if (render_index(md_dir_path) != 200) atomic_fetch_add(&s_warmup.failed, 1);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    printf("Cache warm-up: %zu post(s) and the index in %ld ms, %zu failed\n",
+           s_warmup.count, ms, atomic_load(&s_warmup.failed));
+
+    for (size_t i = 0; i < s_warmup.count; i++) free(s_warmup.paths[i]);
+    free(s_warmup.paths);
+    s_warmup.paths = NULL;
+    atomic_store(&s_warmup.ready, true);
+    return NULL;
+}
+
+static void *warmup_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        size_t i = atomic_fetch_add(&s_warmup.next, 1);
+        if (i >= s_warmup.count) break;
+        if (render_post(s_warmup.paths[i]) != 200) atomic_fetch_add(&s_warmup.failed, 1);
+    }
+    return NULL;
+}
+
+// Adds every post below `dir` to the list. Called with the md_tree lock held.
+static void collect_posts(const MdNode *dir, const char *dir_path) {
+    for (size_t i = 0; i < dir->child_count; i++) {
+        const MdNode *child = dir->children[i];
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir_path, child->name);
+        if (child->is_dir) {
+            collect_posts(child, path);
+            continue;
+        }
+
+        if (s_warmup.count == s_warmup.capacity) {
+            size_t capacity = s_warmup.capacity ? s_warmup.capacity * 2 : 256;
+            char **bigger = realloc(s_warmup.paths, capacity * sizeof(*bigger));
+            if (!bigger) return;
+            s_warmup.paths = bigger;
+            s_warmup.capacity = capacity;
+        }
+        if ((s_warmup.paths[s_warmup.count] = strdup(path)) != NULL) s_warmup.count++;
+    }
+}
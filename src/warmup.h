@@ -0,0 +1,27 @@
+#ifndef WARMUP_H
+#define WARMUP_H
+
+#include <stdbool.h>
+
+/**
+ * @brief Renders every post below md/ and the index into the cache.
+ *
+ * Posts are spread over `threads` threads; the index is built once they are
+ * done. Entries that are still valid in the disk cache are only loaded into
+ * memory, so a warm-up after a restart is cheap. The posts are taken from the
+ * md_tree model, so call this after md_tree_init().
+ *
+ * @param threads Number of warm-up threads.
+ * @param wait If true, returns once the cache is warm. Otherwise the warm-up
+ *             runs in the background and warmup_is_ready() reports its end.
+ */
+void warmup_start(int threads, bool wait);
+
+/**
+ * @brief Returns false while a warm-up started with warmup_start() is still running.
+ *
+ * Always true if no warm-up was started.
+ */
+bool warmup_is_ready(void);
+
+#endif // WARMUP_H
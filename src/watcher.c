@@ -0,0 +1,241 @@
+#include "watcher.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+// Number of hash buckets in the freshness table. Must be a power of two.
+#define FRESHNESS_BUCKETS 1024
+// Once this many paths have changed, the table is cleared and replaced by a
+// reset, so a long-running server on a busy tree doesn't grow it without bound
+#define MAX_FRESHNESS_RECORDS 65536
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | \
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// Generation at which a path last changed.
+typedef struct FreshnessRecord {
+    char *path;
+    unsigned long generation;
+    struct FreshnessRecord *next;
+} FreshnessRecord;
+
+static struct {
+    int fd;
+    char **wd_paths;            // Watched directory path, indexed by watch descriptor
+    int wd_capacity;
+    pthread_t thread;
+    pthread_mutex_t lock;       // Protects `records`, `record_count` and `reset_generation`
+    FreshnessRecord *records[FRESHNESS_BUCKETS];
+    size_t record_count;
+    unsigned long reset_generation; // Everything changed at this generation, e.g. when
+                                    // the event queue overflowed; replaces older records
+    atomic_ulong generation;
+    atomic_bool active;
+    _Atomic(watcher_listener_fn) listener;
+} s_watcher = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Forward declarations
+static void add_watch_recursive(const char *path);
+static void record_change(const char *path);
+static void reset_records(unsigned long generation);
+static void *watcher_thread(void *arg);
+
+bool watcher_start(const char *const *base_paths, int count) {
+    s_watcher.fd = inotify_init1(IN_CLOEXEC);
+    if (s_watcher.fd < 0) {
+        perror("inotify_init1");
+        return false;
+    }
+    atomic_store(&s_watcher.generation, 1);
+    for (int i = 0; i < count; i++) add_watch_recursive(base_paths[i]);
+
+    // Active before the thread runs: events it handles right away must find
+    // the watcher active, and a thread that fails at once must be able to
+    // clear the flag without this store overriding it
+    atomic_store(&s_watcher.active, true);
+    if (pthread_create(&s_watcher.thread, NULL, watcher_thread, NULL) != 0) {
+        atomic_store(&s_watcher.active, false);
+        close(s_watcher.fd);
+        s_watcher.fd = -1;
+        return false;
+    }
+    pthread_detach(s_watcher.thread);
+    return true;
+}
+
+void watcher_set_listener(watcher_listener_fn listener) {
+    atomic_store(&s_watcher.listener, listener);
+}
+
+bool watcher_is_active(void) {
+    return atomic_load(&s_watcher.active);
+}
+
+unsigned long watcher_generation(void) {
+    return atomic_load(&s_watcher.generation);
+}
+
+unsigned long watcher_path_generation(const char *path) {
+    char prefix[PATH_MAX];
+    snprintf(prefix, sizeof(prefix), "%s", path);
+
+    pthread_mutex_lock(&s_watcher.lock);
+    unsigned long latest = s_watcher.reset_generation;
+    // Check the path itself, then each parent directory, so that removing or
+    // renaming a directory invalidates everything below it.
+    for (;;) {
+        FreshnessRecord *rec = s_watcher.records[hash_string(prefix) & (FRESHNESS_BUCKETS - 1)];
+        for (; rec; rec = rec->next) {
+            if (strcmp(rec->path, prefix) == 0) {
+                if (rec->generation > latest) latest = rec->generation;
+                break;
+            }
+        }
+        char *slash = strrchr(prefix, '/');
+        if (!slash || slash == prefix) break;
+        *slash = '\0';
+    }
+    pthread_mutex_unlock(&s_watcher.lock);
+    return latest;
+}
+
+// --- Private helpers ---
+
+static void set_wd_path(int wd, const char *path) {
+    if (wd >= s_watcher.wd_capacity) {
+        int new_capacity = s_watcher.wd_capacity ? s_watcher.wd_capacity * 2 : 64;
+        while (new_capacity <= wd) new_capacity *= 2;
+        char **paths = realloc(s_watcher.wd_paths, new_capacity * sizeof(char *));
+        if (!paths) return;
+        memset(paths + s_watcher.wd_capacity, 0, (new_capacity - s_watcher.wd_capacity) * sizeof(char *));
+        s_watcher.wd_paths = paths;
+        s_watcher.wd_capacity = new_capacity;
+    }
+    free(s_watcher.wd_paths[wd]);
+    s_watcher.wd_paths[wd] = strdup(path);
+}
+
+static void add_watch_recursive(const char *path) {
+    int wd = inotify_add_watch(s_watcher.fd, path, WATCH_MASK | IN_ONLYDIR);
+    if (wd < 0) return;
+    set_wd_path(wd, path);
+
+    DIR *dir = opendir(path);
+    if (!dir) return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        char child[PATH_MAX];
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+        struct stat st;
+        if (stat(child, &st) == 0 && S_ISDIR(st.st_mode)) {
+            add_watch_recursive(child);
+        }
+    }
+    closedir(dir);
+}
+
+static void record_change(const char *path) {
+    pthread_mutex_lock(&s_watcher.lock);
+    unsigned long generation = atomic_load(&s_watcher.generation) + 1;
+    FreshnessRecord **bucket = &s_watcher.records[hash_string(path) & (FRESHNESS_BUCKETS - 1)];
+    FreshnessRecord *rec = *bucket;
+    while (rec && strcmp(rec->path, path) != 0) rec = rec->next;
+    if (!rec && s_watcher.record_count < MAX_FRESHNESS_RECORDS && (rec = calloc(1, sizeof(*rec))) != NULL) {
+        if ((rec->path = strdup(path)) == NULL) {
+            free(rec);
+            rec = NULL;
+        } else {
+            rec->next = *bucket;
+            *bucket = rec;
+            s_watcher.record_count++;
+        }
+    }
+    if (rec) {
+        rec->generation = generation;
+    } else {
+        reset_records(generation); // Table full or out of memory: invalidate everything
+    }
+    // Publish the new generation only after the record is in place, so a reader
+    // that sees it also sees which path it belongs to.
+    atomic_store(&s_watcher.generation, generation);
+    pthread_mutex_unlock(&s_watcher.lock);
+}
+
+// Marks every path as changed at `generation` and frees the records, which
+// can no longer report anything newer. Called with the lock held.
+static void reset_records(unsigned long generation) {
+    for (size_t i = 0; i < FRESHNESS_BUCKETS; i++) {
+        FreshnessRecord *rec = s_watcher.records[i];
+        while (rec) {
+            FreshnessRecord *next = rec->next;
+            free(rec->path);
+            free(rec);
+            rec = next;
+        }
+        s_watcher.records[i] = NULL;
+    }
+    s_watcher.record_count = 0;
+    s_watcher.reset_generation = generation;
+}
+
+static void handle_event(const struct inotify_event *ev) {
+    watcher_listener_fn listener = atomic_load(&s_watcher.listener);
+    if (ev->mask & IN_Q_OVERFLOW) {
+        // Events were lost; everything has to be revalidated the slow way.
+        pthread_mutex_lock(&s_watcher.lock);
+        reset_records(atomic_load(&s_watcher.generation) + 1);
+        atomic_store(&s_watcher.generation, s_watcher.reset_generation);
+        pthread_mutex_unlock(&s_watcher.lock);
+        if (listener) listener(NULL);
+        return;
+    }
+    if (ev->wd < 0 || ev->wd >= s_watcher.wd_capacity || !s_watcher.wd_paths[ev->wd]) return;
+
+    if (ev->mask & IN_IGNORED) {
+        free(s_watcher.wd_paths[ev->wd]);
+        s_watcher.wd_paths[ev->wd] = NULL;
+        return;
+    }
+
+    char path[PATH_MAX];
+    if (ev->len > 0) {
+        snprintf(path, sizeof(path), "%s/%s", s_watcher.wd_paths[ev->wd], ev->name);
+    } else {
+        snprintf(path, sizeof(path), "%s", s_watcher.wd_paths[ev->wd]);
+    }
+
+    if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+        add_watch_recursive(path);
+    }
+    record_change(path);
+    if (listener) listener(path);
+}
+
+static void *watcher_thread(void *arg) {
+    (void)arg;
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t len = read(s_watcher.fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR) continue;
+        if (len <= 0) {
+            // The watcher is gone; callers fall back to checking mtimes.
+            perror("inotify read");
+            atomic_store(&s_watcher.active, false);
+            break;
+        }
+        for (char *p = buf; p < buf + len;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            handle_event(ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,60 @@
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include <stdbool.h>
+
+/**
+ * @brief Starts watching directory trees with inotify on a background thread.
+ *
+ * Every change below one of `base_paths` bumps a global generation counter and
+ * records that generation against the changed path. Request handlers compare
+ * these counters with the generation their cached data was validated at,
+ * instead of calling stat() on every request.
+ *
+ * @param base_paths Absolute paths of the directories to watch (e.g. md/ and templates/).
+ * @param count The number of paths.
+ * @return true if the watcher is running, false if inotify is unavailable.
+ */
+bool watcher_start(const char *const *base_paths, int count);
+
+/**
+ * @brief Called on the watcher thread for each changed path.
+ *
+ * @param path Absolute path of the file or directory that changed, or NULL
+ *             when events were lost and anything may have changed.
+ */
+typedef void (*watcher_listener_fn)(const char *path);
+
+/**
+ * @brief Registers a function to be told about every change, e.g. to keep an
+ * in-memory model of a watched tree current.
+ *
+ * The listener runs after the change is recorded, so it already sees the new
+ * generation of the path. There is a single listener; a second call replaces
+ * the first.
+ */
+void watcher_set_listener(watcher_listener_fn listener);
+
+/**
+ * @brief Returns true once watcher_start() has succeeded.
+ *
+ * When false, callers must fall back to checking modification times themselves.
+ */
+bool watcher_is_active(void);
+
+/**
+ * @brief Returns the current global generation. Increases on every change below the watched tree.
+ */
+unsigned long watcher_generation(void);
+
+/**
+ * @brief Returns the generation at which `path` or one of its parent directories last changed.
+ *
+ * Data validated at generation G is still fresh if this returns a value <= G.
+ *
+ * @param path Absolute path of a file or directory below a watched tree.
+ * @return The generation of the latest relevant change, or 0 if nothing changed since startup.
+ */
+unsigned long watcher_path_generation(const char *path);
+
+#endif // WATCHER_H